@@ -29,189 +29,3028 @@
  */
 
 #include "Particle.h"
-#include <algorithm> // std::min
+#include <algorithm> // std::min, std::max
+#include <atomic>
+
+using std::min;
+using std::max;
 
 SYSTEM_THREAD(ENABLED);
 // SYSTEM_MODE(SEMI_AUTOMATIC);	// prevent load of modem occurring automatically
 SYSTEM_MODE(MANUAL);    // prevent load of modem occurring automatically
 
-// If we lose power completely, expect these to reinitialize.
-// Hey User! Try to characterize the worst case scenario to prevent complete power loss.
-retained float last_battery_capacity = 0;
-retained uint32_t low_batt_sleep_attempts = 0;
+// If we lose power completely, expect these to reinitialize.
+// Hey User! Try to characterize the worst case scenario to prevent complete power loss.
+retained float last_battery_capacity = 0;
+retained uint32_t low_batt_sleep_attempts = 0;
+
+const float LOW_BATT_CAPACITY = 20.0; // 20.0 is lowest it should be set at
+const float MAX_LOW_BATT_CAPACITY = 80.0;
+const float NOMINAL_CAPACITY_MAH = 2000.0;  // the LiPo that ships with the Electron
+
+/*
+ * Hibernate policy - the threshold and backoff curve, set per device with the [p]olicy command
+ * so the backend can push the policy recommended for the cluster of devices with similar loads.
+ * Retained memory is not guaranteed to be initialized after a firmware update, so always read
+ * it through sleep_policy() which falls back to the defaults.
+ */
+const uint32_t POLICY_MAGIC = 0x9011C702;
+const uint32_t DEFAULT_BACKOFF_BASE = 24*60;    // seconds, see qualify_battery_and_hibernate()
+const uint32_t MIN_BACKOFF_BASE = 5*60;
+const uint32_t MAX_BACKOFF_BASE = 6*60*60;
+const uint8_t DEFAULT_BACKOFF_MAX_EXPONENT = 7; // 24 minutes * 2^7 = 51.2 hours
+const uint8_t MAX_BACKOFF_MAX_EXPONENT = 10;
+
+struct sleep_policy_t {
+    uint32_t magic;
+    float low_batt_capacity;        // hibernate below this (%)
+    uint32_t backoff_base;          // first hibernate duration (seconds)
+    uint8_t backoff_max_exponent;   // longest hibernate is backoff_base * 2^this
+    uint16_t version;               // chosen by the backend, reported in DIAG
+    uint8_t standby_soc;            // hibernate in network standby at or above this (%), 0 never
+};
+retained sleep_policy_t policy;
+#define MY_SERIAL serial_console   // Serial1, gated by the power manager
+#define SERIAL_DEBUGGING
+
+/*
+ * Trace log - breadcrumbs in retained memory, so they survive the reset that follows a crash.
+ * Each event is one word: [31:24] event, [23:16] argument, [15:0] seconds since boot (wrapping).
+ * The task the scheduler is running, uptime and free heap are refreshed once a second.
+ * Events can come from the system thread (synchronous cloud commands), hence the block.
+ */
+const uint32_t TRACE_MAGIC = 0x7ACE0001;
+const uint8_t TRACE_EVENTS = 16;
+const uint8_t TRACE_NO_TASK = 0xFF;
+
+enum trace_event_t {
+    TRACE_BOOT = 1,     // reset reason
+    TRACE_TASK,         // scheduled task id
+    TRACE_CMD,          // command key
+    TRACE_PUBLISH,      // first letter of the event name
+    TRACE_SLEEP,        // 0 soft power off, 1 network standby, 2 crash loop
+    TRACE_WAKE,         // wake reason
+    TRACE_PROFILE,      // power profile id
+};
+
+struct trace_log_t {
+    uint32_t magic;
+    uint8_t head;
+    uint8_t count;
+    uint8_t active_task;
+    uint8_t reserved;
+    uint32_t up;            // seconds since boot at the last heartbeat
+    uint32_t heap_free;
+    uint32_t events[TRACE_EVENTS];
+};
+retained trace_log_t trace_log;
+
+void trace_reset() {
+    memset(&trace_log, 0, sizeof(trace_log));
+    trace_log.magic = TRACE_MAGIC;
+    trace_log.active_task = TRACE_NO_TASK;
+}
+
+/*
+ * Trace capture buffer - while a capture session is recording (see [t]) every trace event also
+ * goes here, flagged by bit 31, next to the high rate samples.  Plain RAM, a capture doesn't
+ * need to survive a reset.
+ */
+const uint16_t CAPTURE_WORDS = 1024;
+
+struct capture_t {
+    bool recording;
+    uint16_t session;
+    uint16_t len;
+    uint32_t words[CAPTURE_WORDS];
+};
+capture_t capture;
+
+/*
+ * Only with threads blocked, see trace() and capture_sample().
+ */
+void capture_append(uint32_t word) {
+    if (capture.len < CAPTURE_WORDS) capture.words[capture.len++] = word;
+}
+
+/*
+ * Rough app thread stack watermark: the deepest local seen in trace(), measured from the top of
+ * setup().  Device OS doesn't report the app thread's stack use, and trace() is called from
+ * the deepest paths (publishing, commands, sleeping).  System thread calls fall outside the
+ * window and are ignored.
+ */
+const uint32_t APP_STACK_WINDOW = 8*1024;
+uintptr_t stack_top = 0;
+uint32_t stack_used_max = 0;
+
+inline void stack_mark() {
+    uint8_t here;
+    uintptr_t sp = (uintptr_t)&here;
+    if (sp < stack_top && stack_top - sp < APP_STACK_WINDOW) {
+        stack_used_max = max(stack_used_max, (uint32_t)(stack_top - sp));
+    }
+}
+
+void trace(uint8_t event, uint8_t arg) {
+    stack_mark();
+    uint32_t word = ((uint32_t)event << 24) | ((uint32_t)arg << 16) | ((millis() / 1000) & 0xFFFF);
+    SINGLE_THREADED_BLOCK() {
+        if (trace_log.magic != TRACE_MAGIC) trace_reset();
+        trace_log.events[trace_log.head] = word;
+        trace_log.head = (trace_log.head + 1) % TRACE_EVENTS;
+        if (trace_log.count < TRACE_EVENTS) trace_log.count++;
+        if (capture.recording) capture_append(0x80000000 | word);
+    }
+}
+
+void trace_heartbeat() {
+    trace_log.up = millis() / 1000;
+    trace_log.heap_free = System.freeMemory();
+}
+
+/*
+ * Heap lock - after setup() the app should run from static and stack memory only, so months of
+ * uptime can't fragment the heap and no timer or loop() path waits on malloc.  Every buffer is
+ * sized at compile time (command queue, history store, formatting buffers on the stack).
+ *
+ * With HEAP_LOCK_AFTER_SETUP, operator new counts any allocation made after setup(), and
+ * HEAP_LOCK_TRAP turns the first one into a hard fault (SOS) so it can't be missed on the bench.
+ * Particle's String and the system firmware allocate with malloc() directly, which the app can't
+ * hook, so loop() also watches the free heap for growth below its size when the lock was taken.
+ * Particle.function handlers still get their argument as a String from the system, which is why
+ * that path is excluded.  Use [m] to check the counters.
+ */
+#define HEAP_LOCK_AFTER_SETUP
+// #define HEAP_LOCK_TRAP
+
+volatile bool heap_locked = false;
+volatile uint32_t heap_locked_allocs = 0;
+uint32_t heap_free_at_lock = 0;
+uint32_t heap_free_min = 0;
+uint32_t heap_last_check = 0;
+
+#ifdef HEAP_LOCK_AFTER_SETUP
+void* heap_alloc(size_t size) {
+    if (heap_locked) {
+        heap_locked_allocs++;
+        #ifdef HEAP_LOCK_TRAP
+            __builtin_trap();
+        #endif
+    }
+    return malloc(size);
+}
+
+void* operator new(size_t size) { return heap_alloc(size); }
+void* operator new[](size_t size) { return heap_alloc(size); }
+void operator delete(void* ptr) { free(ptr); }
+void operator delete[](void* ptr) { free(ptr); }
+#endif
+
+void heap_lock() {
+    heap_free_at_lock = heap_free_min = System.freeMemory();
+    heap_locked = true;
+}
+
+void heap_watch() {
+    if (!heap_locked || millis() - heap_last_check < 1000) return;
+    heap_last_check = millis();
+    heap_free_min = min(heap_free_min, (uint32_t)System.freeMemory());
+    trace_heartbeat();
+}
+
+/*
+ * Power manager - peripherals stay powered only while something uses them.  Users acquire and
+ * release a resource (reference counted), or touch it for one-off use, and once nothing holds
+ * it for its idle timeout it's gated off.  Time on is added up per resource, see [o].
+ *
+ * - Serial1: only input counts as use, so periodic debug output doesn't keep it on.  While it's
+ *   off the RX pin wakes it on the first incoming byte (that byte is lost), and output is dropped.
+ * - D7 LED: the heartbeat only blinks while the serial console is on, then goes dark.
+ * - I2C: the fuel gauge shares its bus with the system firmware's PMIC handling, so it's never
+ *   actually disabled.  Its time on only counts touches, not bus activity, so [o] leaves it out.
+ * - Modem: disconnected and powered down once idle.  Touching it powers it up and reconnects in
+ *   the background.  The idle timeout is longer than the default publish cadence, so it only
+ *   gates when a sleep plan slows publishing down.
+ * All of it runs on the app thread, except cloud commands which only flag activity.
+ */
+enum power_resource_id_t {
+    POWER_SERIAL,
+    POWER_LED,
+    POWER_I2C,
+    POWER_MODEM,
+    NUM_POWER_RESOURCES
+};
+
+struct power_resource_t {
+    const char* name;
+    uint32_t idle_timeout;  // ms
+    void (*on)();
+    void (*off)();
+    uint8_t refs;
+    bool powered;
+    bool held_off;          // power_hold_off(), nothing can power it up
+    uint32_t last_used;     // millis()
+    uint32_t on_since;      // millis()
+    uint32_t on_total;      // ms, not counting the current stretch
+};
+
+volatile bool serial_wake_requested = false;
+uint32_t governor_idle_ms = 0;  // app thread parked by governor_idle()
+uint32_t governor_bursts = 0;   // loop() passes with work pending
+std::atomic<bool> cloud_activity(false);     // set by cloud_cmd() in the system thread
+
+void serial_rx_wake() {
+    serial_wake_requested = true;
+}
+
+void serial_power_on() {
+    detachInterrupt(RX);
+    Serial1.begin(9600);
+}
+
+void serial_power_off() {
+    Serial1.end();
+    attachInterrupt(RX, serial_rx_wake, FALLING);
+}
+
+void led_power_off() {
+    digitalWrite(D7, LOW);
+}
+
+/*
+ * Connect stats, for the [d] bundle: how often the modem had to (re)connect and how long it took.
+ */
+uint16_t modem_connects = 0;
+uint32_t modem_connect_started = 0;     // millis(), 0 when not connecting
+uint32_t modem_connect_ms = 0;          // the last connect took
+
+void modem_power_on() {
+    Cellular.on();
+    Particle.connect();
+    modem_connect_started = millis();
+}
+
+void modem_connect_process() {
+    if (modem_connect_started == 0 || !Particle.connected()) return;
+    modem_connect_ms = millis() - modem_connect_started;
+    modem_connect_started = 0;
+    modem_connects++;
+}
+
+void modem_power_off() {
+    Particle.disconnect();
+    Cellular.off();
+}
+
+void power_none() {
+}
+
+power_resource_t power_resources[NUM_POWER_RESOURCES] = {
+    { "serial1", 10*60*1000, serial_power_on, serial_power_off },
+    { "d7 led",  1000,       power_none,      led_power_off },
+    { "i2c",     1000,       power_none,      power_none },
+    { "modem",   5*60*1000,  modem_power_on,  modem_power_off },
+};
+
+void power_up(power_resource_t& res) {
+    if (res.held_off) return;
+    res.last_used = millis();
+    if (res.powered) return;
+    res.powered = true;
+    res.on_since = res.last_used;
+    res.on();
+}
+
+void power_down(power_resource_t& res) {
+    if (!res.powered) return;
+    res.powered = false;
+    res.on_total += millis() - res.on_since;
+    res.off();
+}
+
+void power_acquire(uint8_t id) {
+    power_resource_t& res = power_resources[id];
+    if (res.refs < 255) res.refs++;
+    power_up(res);
+}
+
+void power_release(uint8_t id) {
+    power_resource_t& res = power_resources[id];
+    if (res.refs > 0) res.refs--;
+    res.last_used = millis();
+}
+
+void power_touch(uint8_t id) {
+    power_up(power_resources[id]);
+}
+
+/*
+ * Gate a resource off now and keep it off, whoever touches it, until the hold is lifted.  For
+ * measurements that need it off, like the characterization's cpu busy step.
+ */
+void power_hold_off(uint8_t id, bool hold) {
+    power_resource_t& res = power_resources[id];
+    res.held_off = hold;
+    if (hold) power_down(res);
+}
+
+bool power_is_on(uint8_t id) {
+    return power_resources[id].powered;
+}
+
+uint32_t power_on_time(uint8_t id) {
+    const power_resource_t& res = power_resources[id];
+    return res.on_total + (res.powered ? millis() - res.on_since : 0);
+}
+
+/*
+ * Everything starts powered, setup() has just brought it all up.
+ */
+void power_init() {
+    for (uint8_t i = 0; i < NUM_POWER_RESOURCES; i++) {
+        power_resources[i].powered = true;
+        power_resources[i].on_since = power_resources[i].last_used = millis();
+    }
+}
+
+void power_process() {
+    if (serial_wake_requested) {
+        serial_wake_requested = false;
+        power_touch(POWER_SERIAL);
+    }
+    if (cloud_activity.exchange(false)) {
+        power_touch(POWER_MODEM);
+    }
+    modem_connect_process();
+    for (uint8_t i = 0; i < NUM_POWER_RESOURCES; i++) {
+        power_resource_t& res = power_resources[i];
+        if (res.powered && res.refs == 0 && millis() - res.last_used > res.idle_timeout) {
+            power_down(res);
+        }
+    }
+}
+
+/*
+ * Serial1 as seen by the rest of the app: drops output while the port is gated, and counts
+ * input as use.
+ */
+class SerialConsole : public Stream {
+public:
+    void begin(unsigned long baud) {
+        Serial1.begin(baud);
+    }
+
+    virtual int available() {
+        return power_is_on(POWER_SERIAL) ? Serial1.available() : 0;
+    }
+
+    virtual int read() {
+        if (!power_is_on(POWER_SERIAL)) return -1;
+        int c = Serial1.read();
+        if (c >= 0) power_touch(POWER_SERIAL);
+        return c;
+    }
+
+    virtual int peek() {
+        return power_is_on(POWER_SERIAL) ? Serial1.peek() : -1;
+    }
+
+    virtual void flush() {
+        if (power_is_on(POWER_SERIAL)) Serial1.flush();
+    }
+
+    virtual size_t write(uint8_t c) {
+        return power_is_on(POWER_SERIAL) ? Serial1.write(c) : 1;
+    }
+    using Print::write;
+};
+SerialConsole serial_console;
+
+/*
+ * Power profiles - every knob that trades energy for visibility, switched as one unit with [M]
+ * from Serial1 or the cloud, or automatically by SoC band.  Each profile is a constant table
+ * entry and the app reads its settings through profile(), so a switch can't leave a mix of two
+ * profiles behind.  Requests only post the new profile (any thread), loop() applies it between
+ * passes.  A sleep plan still sets the publish cadence while it's active.
+ *
+ * production is the app's behaviour from before profiles.  In auto mode the device runs
+ * production, drops to storm saver below PROFILE_STORM_SOC and goes back above PROFILE_CALM_SOC.
+ * [o] shows what each one costs in peripheral time on.
+ */
+const uint32_t NEVER = 0xFFFFFFFF;
+
+struct power_profile_t {
+    const char* name;
+    uint32_t publish_cadence;   // seconds between UPDATE events
+    uint32_t battery_poll_ms;
+    uint32_t serial_idle_ms;    // Serial1 console gated after this long without input
+    uint32_t modem_idle_ms;
+    bool heartbeat;             // blink D7 while the console is on
+    float threshold_floor;      // hibernate below at least this (%)
+};
+
+enum power_profile_id_t {
+    PROFILE_COMMISSIONING,
+    PROFILE_PRODUCTION,
+    PROFILE_STORM_SAVER,
+    NUM_PROFILES
+};
+
+const power_profile_t profiles[NUM_PROFILES] = {
+    { "commissioning", 15,      2*1000,  NEVER,      NEVER,      true,  0 },
+    { "production",    60,      10*1000, 10*60*1000, 5*60*1000,  true,  0 },
+    { "storm",         30*60,   60*1000, 60*1000,    60*1000,    false, 30.0 },
+};
+
+const uint8_t PROFILE_AUTO = 0x80;   // flag in profile_setting
+const float PROFILE_STORM_SOC = 40.0;
+const float PROFILE_CALM_SOC = 50.0;
+
+/*
+ * Retained memory isn't initialized after a fresh flash or a layout change, and a zero setting
+ * would be commissioning, so the setting only counts with its magic next to it.
+ */
+const uint32_t PROFILE_MAGIC = 0x9F0F1E01;
+retained uint32_t profile_magic;
+retained uint8_t profile_setting;   // profile id, or'ed with PROFILE_AUTO
+uint8_t profile_active = PROFILE_PRODUCTION;
+
+const power_profile_t& profile() {
+    return profiles[profile_active];
+}
+
+void profile_apply(uint8_t id) {
+    profile_active = id;
+    power_resources[POWER_SERIAL].idle_timeout = profiles[id].serial_idle_ms;
+    power_resources[POWER_MODEM].idle_timeout = profiles[id].modem_idle_ms;
+    // show up on the console in the new profile, unless it's one that runs dark (storm saver)
+    if (profiles[id].heartbeat) power_touch(POWER_SERIAL);
+}
+
+uint32_t lastBlink = 0;
+
+/*
+ * History store - a ring of battery samples kept in retained memory so a characterization
+ * run can still be dumped after a reset.  The backup SRAM is only 4KB and also has to hold
+ * the backoff state, so samples are bit-packed into one 32-bit word each:
+ *
+ *   [31:22] dt    seconds since the previous sample (0-1023)
+ *   [21:10] dmv   VCell change since the previous sample (mV, signed 12-bit)
+ *   [ 9: 0] soc   SoC in 0.1% steps (0-1000)
+ *
+ * Only the newest sample's time and VCell are kept in full (the anchor), older samples are
+ * rebuilt by walking backwards, so overwriting the oldest word never breaks decoding.  A gap
+ * longer than 1023s (e.g. a hibernate) is written as an extra gap word with soc = 1023 and a
+ * 22-bit dt (up to 48 days) just before the sample.
+ *
+ * Every sample gets the next sequence number, persistently, so the backend can detect lost and
+ * duplicated UPDATEs.  Sequence numbers aren't stored per word, they count back from the anchor.
+ *
+ * A naive struct of floats like last_battery_capacity (time, soc, vcell) takes 12 bytes, so
+ * the same 2KB would hold 170 samples, or 2.8 hours at one sample per minute.  Packed, it
+ * holds 507 samples, 8.5 hours.
+ */
+const uint16_t HISTORY_WORDS = 507;
+const uint32_t HISTORY_SOC_BITS = 10;
+const uint32_t HISTORY_DMV_BITS = 12;
+const uint32_t HISTORY_DT_BITS = 10;
+const uint32_t HISTORY_GAP_MARK = (1 << HISTORY_SOC_BITS) - 1;
+const uint32_t HISTORY_DT_MAX = (1 << HISTORY_DT_BITS) - 1;
+const uint32_t HISTORY_GAP_MAX = (1 << (32 - HISTORY_SOC_BITS)) - 1;
+const uint16_t HISTORY_MV_MIN = 2600;   // clamp range narrower than 2^11 mV, so dmv never overflows
+const uint16_t HISTORY_MV_MAX = 4600;
+
+struct history_store_t {
+    uint32_t newest_seq;    // sequence number of the newest sample
+    uint32_t acked_seq;     // highest contiguous sequence number the backend has
+    uint32_t newest_time;   // Time.now() of the newest sample
+    uint16_t newest_mv;     // VCell of the newest sample
+    uint16_t head;          // next word to write
+    uint16_t count;         // words in use
+    uint16_t samples;       // samples in use (count minus gap words)
+    uint32_t words[HISTORY_WORDS];
+};
+retained history_store_t history;
+
+static_assert(HISTORY_SOC_BITS + HISTORY_DMV_BITS + HISTORY_DT_BITS == 32, "history record must pack into 32 bits");
+static_assert(HISTORY_GAP_MARK > 1000, "gap marker must not be a valid SoC");
+static_assert(HISTORY_MV_MAX - HISTORY_MV_MIN < (1 << (HISTORY_DMV_BITS - 1)), "VCell range must fit the dmv field");
+static_assert(sizeof(history_store_t) == 20 + 4 * HISTORY_WORDS, "history store must not have padding");
+static_assert(sizeof(history_store_t) <= 2 * 1024, "history store must leave room in the 4KB backup SRAM");
+
+inline uint32_t history_encode(uint16_t soc_tenths, int16_t dmv, uint16_t dt) {
+    return ((uint32_t)dt << (HISTORY_SOC_BITS + HISTORY_DMV_BITS))
+         | (((uint32_t)dmv & ((1 << HISTORY_DMV_BITS) - 1)) << HISTORY_SOC_BITS)
+         | soc_tenths;
+}
+
+inline uint16_t history_soc(uint32_t word) {
+    return word & ((1 << HISTORY_SOC_BITS) - 1);
+}
+
+inline int16_t history_dmv(uint32_t word) {
+    return (int32_t)(word << HISTORY_DT_BITS) >> (32 - HISTORY_DMV_BITS);  // sign extend
+}
+
+inline uint32_t history_dt(uint32_t word) {
+    return (history_soc(word) == HISTORY_GAP_MARK) ? word >> HISTORY_SOC_BITS
+                                                    : word >> (HISTORY_SOC_BITS + HISTORY_DMV_BITS);
+}
+
+void startup() {
+    System.enableFeature(FEATURE_RETAINED_MEMORY);
+    System.enableFeature(FEATURE_RESET_INFO);   // System.resetReason() for the WAKE event
+}
+STARTUP(startup());
+
+/**
+ * Series In: 1, 2, 3, 4, 5...n
+ * Series Out: 1 (2 times), 2, 4, 8, 16, 32, 64, 128 seconds (3 times each) thereafter
+ * @param attempt_num The current attempt number.
+ * @param max_exponent Stop doubling after 2^max_exponent.
+ * @return The number of milliseconds to backoff.
+ */
+uint32_t sleep_backoff(uint32_t attempt_num, uint32_t max_exponent = 7)
+{
+    if (attempt_num == 0)
+        return 0;
+    uint32_t exponent = min(max_exponent, attempt_num/3);
+    return 1000*(1<<exponent);
+}
+
+/*
+ * @param capacity The value to compare current battery to.
+ * @return If battery is lower than `capacity`, return `true`.
+ */
+bool battery_lower_than(float capacity)
+{
+    return (FuelGauge().getSoC() < capacity) ? 1 : 0;
+}
+
+void reset_battery_capacity() {
+    FuelGauge().quickStart();
+    // must delay at least 175ms after quickstart, before calling
+    // getSoC(), or reading will not have updated yet.
+    delay(200);
+}
+
+/*
+ * Latest battery state, readable from any thread without locks or I2C traffic.  Cloud
+ * function handlers (system thread), timer callbacks and loop() all want it, and having each
+ * of them query the fuel gauge or take a mutex would add latency and priority inversion.
+ *
+ * loop() is the single writer, and publishes through a seqlock: the sequence number is odd
+ * while an update is in progress, so a reader retries if it saw an odd number or the number
+ * changed while it was copying.  The writer's stores are also done with thread switching off,
+ * so on this single core MCU a reader can never preempt a half finished update and spin.
+ */
+struct battery_state_t {
+    float soc;              // (%)
+    float vcell;            // (V)
+    float discharge_rate;   // (%/h) see battery_usage_t
+    float charge_rate;      // (%/h)
+    uint32_t updated;       // millis() of the reading
+};
+
+std::atomic<uint32_t> battery_state_seq(0);
+battery_state_t battery_state_data;
+
+void battery_state_store(const battery_state_t& state) {
+    SINGLE_THREADED_BLOCK() {
+        uint32_t seq = battery_state_seq.load(std::memory_order_relaxed);
+        battery_state_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        battery_state_data = state;
+        battery_state_seq.store(seq + 2, std::memory_order_release);
+    }
+}
+
+battery_state_t battery_state() {
+    battery_state_t state;
+    uint32_t seq;
+    do {
+        seq = battery_state_seq.load(std::memory_order_acquire);
+        state = battery_state_data;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != battery_state_seq.load(std::memory_order_relaxed));
+    return state;
+}
+
+void history_clear() {
+    history.head = history.count = history.samples = 0;
+    history.newest_seq = history.acked_seq = 0;
+}
+
+/*
+ * Retained memory isn't guaranteed to be initialized after a firmware update.
+ */
+void history_init() {
+    if (history.count > HISTORY_WORDS || history.head >= HISTORY_WORDS || history.samples > history.count
+            || history.acked_seq > history.newest_seq) {
+        history_clear();
+    }
+}
+
+void history_push(uint32_t word) {
+    if (history.count == HISTORY_WORDS) {
+        uint32_t oldest = history.words[(history.head + HISTORY_WORDS - history.count) % HISTORY_WORDS];
+        if (history_soc(oldest) != HISTORY_GAP_MARK) history.samples--;
+        history.count--;
+    }
+    history.words[history.head] = word;
+    history.head = (history.head + 1) % HISTORY_WORDS;
+    history.count++;
+}
+
+/*
+ * The header is also read from the system thread by [a]ck, so the ring is only touched with
+ * thread switching off.
+ * @return The sample's sequence number.
+ */
+uint32_t history_append(float soc, float vcell) {
+    uint32_t now = Time.now();
+    uint16_t mv = min(max((int)(vcell * 1000 + 0.5), (int)HISTORY_MV_MIN), (int)HISTORY_MV_MAX);
+    uint16_t soc_tenths = min(max((int)(soc * 10 + 0.5), 0), 1000);
+    SINGLE_THREADED_BLOCK() {
+        uint32_t dt = 0;
+        int16_t dmv = 0;
+        if (history.samples > 0) {
+            dt = (now > history.newest_time) ? now - history.newest_time : 0; // RTC stepped back, treat as no gap
+            dmv = mv - history.newest_mv;
+        }
+        if (dt > HISTORY_DT_MAX) {
+            history_push((min(dt, HISTORY_GAP_MAX) << HISTORY_SOC_BITS) | HISTORY_GAP_MARK);
+            dt = 0;
+        }
+        history_push(history_encode(soc_tenths, dmv, dt));
+        history.samples++;
+        history.newest_seq++;
+        history.newest_time = now;
+        history.newest_mv = mv;
+    }
+    return history.newest_seq;
+}
+
+/*
+ * Where a sample is in the ring, with its full time and VCell.
+ */
+struct history_cursor_t {
+    uint16_t idx;       // word index of the sample
+    uint16_t words;     // words from idx up to the newest, inclusive
+    uint32_t time;
+    int32_t mv;
+};
+
+/*
+ * Walks back from the anchor to the sample numbered `seq`, or the oldest sample held if that
+ * one has already been overwritten.  History must not be empty.
+ * @return The sequence number of the sample `cursor` points at.
+ */
+uint32_t history_locate(uint32_t seq, history_cursor_t& cursor) {
+    uint32_t time = history.newest_time;
+    int32_t mv = history.newest_mv;
+    uint32_t found = history.newest_seq + 1;
+    uint16_t idx = history.head;
+    for (uint16_t words = 1; words <= history.count; words++) {
+        idx = (idx + HISTORY_WORDS - 1) % HISTORY_WORDS;
+        uint32_t word = history.words[idx];
+        if (history_soc(word) != HISTORY_GAP_MARK) {
+            found--;
+            cursor.idx = idx;
+            cursor.words = words;
+            cursor.time = time;
+            cursor.mv = mv;
+            if (found <= seq) break;
+            mv -= history_dmv(word);
+        }
+        time -= history_dt(word);
+    }
+    return found;
+}
+
+/*
+ * @param out Where to print the CSV.
+ * @param count Print only the newest `count` samples.
+ */
+void history_dump(Print& out, uint16_t count) {
+    count = min(count, history.samples);
+    out.println("seq,time,soc(%),vcell(V)");
+    if (count == 0) return;
+
+    history_cursor_t cursor;
+    uint32_t seq = history_locate(history.newest_seq + 1 - count, cursor);
+    uint32_t time = cursor.time;
+    int32_t mv = cursor.mv;
+    uint16_t idx = cursor.idx;
+    for (uint16_t i = 0; i < cursor.words; i++) {
+        uint32_t word = history.words[idx];
+        if (i > 0) time += history_dt(word);
+        if (history_soc(word) != HISTORY_GAP_MARK) {
+            if (i > 0) mv += history_dmv(word);
+            out.printlnf("%lu,%lu,%.1f,%.3f", seq++, time, history_soc(word) / 10.0, mv / 1000.0);
+        }
+        idx = (idx + 1) % HISTORY_WORDS;
+    }
+}
+
+/*
+ * Standard base64, for binary payloads in events.
+ * @return The length written, not counting the terminator.
+ */
+size_t base64_encode(const uint8_t* data, size_t len, char* out, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t n = 0;
+    for (size_t i = 0; i < len && n + 4 < size; i += 3) {
+        uint32_t triple = (uint32_t)data[i] << 16;
+        if (i + 1 < len) triple |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) triple |= data[i + 2];
+        out[n++] = alphabet[(triple >> 18) & 0x3F];
+        out[n++] = alphabet[(triple >> 12) & 0x3F];
+        out[n++] = (i + 1 < len) ? alphabet[(triple >> 6) & 0x3F] : '=';
+        out[n++] = (i + 2 < len) ? alphabet[triple & 0x3F] : '=';
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/*
+ * Delta sync - the backend acknowledges the highest contiguous sequence number it has with
+ * the [a]ck command, and the device answers with the samples after it that are still in the
+ * history store, one "RESEND" event per ack.  The backend keeps acking until it's caught up,
+ * so after an outage only the gaps are uploaded, at 4 bytes per sample:
+ *
+ *   RESEND  seq=<first seq>,t=<time>,mv=<VCell mV>,w=<base64 history words>
+ *
+ * The first word is the sample numbered `seq` with the full time and VCell given in the header,
+ * every following word is decoded exactly like the history store (see above).  If `seq` is
+ * higher than requested, the older samples were overwritten before they could be resent.
+ * Characterization logs to the history without publishing UPDATEs, so a run shows up as a gap in
+ * the UPDATE seq numbers.  That is on purpose: the backend acks up to the gap like after an outage,
+ * and the RESEND that follows is how the run's log gets uploaded.
+ */
+const uint16_t RESEND_MAX_WORDS = 36;   // keeps the event under 255 bytes
+volatile bool resend_pending = false;
+
+void resend_process() {
+    if (!resend_pending) return;
+    power_touch(POWER_MODEM);
+    if (!Particle.connected()) return;
+    resend_pending = false;
+
+    uint32_t words[RESEND_MAX_WORDS];
+    uint16_t num_words = 0;
+    uint32_t seq;
+    history_cursor_t cursor;
+    SINGLE_THREADED_BLOCK() {
+        if (history.samples == 0 || history.acked_seq >= history.newest_seq) return;
+        seq = history_locate(history.acked_seq + 1, cursor);
+        num_words = min(cursor.words, RESEND_MAX_WORDS);
+        for (uint16_t i = 0; i < num_words; i++) {
+            words[i] = history.words[(cursor.idx + i) % HISTORY_WORDS];
+        }
+    }
+
+    char event[255];
+    int len = snprintf(event, sizeof(event), "seq=%lu,t=%lu,mv=%ld,w=", seq, cursor.time, cursor.mv);
+    base64_encode((const uint8_t*)words, num_words * sizeof(words[0]), event + len, sizeof(event) - len);
+    trace(TRACE_PUBLISH, 'R');
+    Particle.publish("RESEND", event);
+}
+
+/*
+ * Trace capture - debugging a fast drain on site without a bench cable.  [t] <minutes>,<sample s>
+ * records for a bounded window: every trace event plus a SoC/VCell sample every few seconds,
+ * packed into 4 byte words in the RAM buffer above (a CSV row would take ~30 bytes):
+ *   sample  [31] 0, [30:20] VCell - 2600 (mV, clamped like the history), [19:10] SoC (0.1%),
+ *           [9:0] seconds since boot (wrapping)
+ *   event   [31] 1, [30:24] trace event, [23:16] argument, [15:0] seconds since boot (wrapping)
+ * When the window ends (or the buffer fills, or [t] 0) it's uploaded as sequence numbered chunks
+ *   TRACE s=<session>,c=<chunk>/<chunks>,t=<start, s since boot>,w=<base64 words>
+ * one every CAPTURE_UPLOAD_MS while connected, so a session costs at most ~7KB of data spread
+ * over a few minutes instead of a burst.  The host sorts chunks by c and concatenates the words,
+ * [T] <chunk> sends a lost one again.
+ */
+const uint32_t CAPTURE_MAX_MINUTES = 60;
+const uint32_t CAPTURE_UPLOAD_MS = 5000;
+const uint16_t CAPTURE_CHUNK_WORDS = 36;    // like RESEND, keeps the event under 255 bytes
+
+uint32_t capture_period_ms = 0;
+uint32_t capture_start_ms = 0;
+uint32_t capture_window_ms = 0;
+uint32_t capture_last_sample_ms = 0;
+uint32_t capture_last_upload_ms = 0;
+uint16_t capture_next_chunk = 0;
+bool capture_uploading = false;
+int16_t capture_resend_chunk = -1;
+
+uint16_t capture_chunks() {
+    return (capture.len + CAPTURE_CHUNK_WORDS - 1) / CAPTURE_CHUNK_WORDS;
+}
+
+void capture_start(uint32_t minutes, uint32_t period_s) {
+    capture.session++;
+    capture.len = 0;
+    capture_period_ms = period_s * 1000;
+    capture_window_ms = minutes * 60000;
+    capture_start_ms = millis();
+    capture_last_sample_ms = 0;
+    capture_uploading = false;
+    capture_resend_chunk = -1;
+    capture.recording = true;
+}
+
+void capture_stop() {
+    capture.recording = false;
+    capture_uploading = true;
+    capture_next_chunk = 0;
+    capture_last_upload_ms = 0;
+}
+
+void capture_sample() {
+    power_touch(POWER_I2C);
+    float soc = FuelGauge().getSoC();
+    float vcell = FuelGauge().getVCell();
+    uint32_t mv = min(max((int)(vcell * 1000 + 0.5), (int)HISTORY_MV_MIN), (int)HISTORY_MV_MAX) - HISTORY_MV_MIN;
+    uint32_t soc10 = min(max((int)(soc * 10 + 0.5), 0), 1000);
+    uint32_t word = (mv << 20) | (soc10 << 10) | ((millis() / 1000) & 0x3FF);
+    SINGLE_THREADED_BLOCK() {
+        capture_append(word);
+    }
+}
+
+void capture_publish(uint16_t chunk) {
+    uint16_t first = chunk * CAPTURE_CHUNK_WORDS;
+    uint16_t num_words = min((uint16_t)(capture.len - first), CAPTURE_CHUNK_WORDS);
+    char event[255];
+    int len = snprintf(event, sizeof(event), "s=%u,c=%u/%u,t=%lu,w=", capture.session, chunk,
+            capture_chunks(), capture_start_ms / 1000);
+    base64_encode((const uint8_t*)(capture.words + first), num_words * sizeof(capture.words[0]),
+            event + len, sizeof(event) - len);
+    Particle.publish("TRACE", event);
+}
+
+void capture_process() {
+    uint32_t now = millis();
+    if (capture.recording) {
+        if (capture_last_sample_ms == 0 || now - capture_last_sample_ms >= capture_period_ms) {
+            capture_last_sample_ms = now;
+            capture_sample();
+        }
+        if (now - capture_start_ms >= capture_window_ms || capture.len >= CAPTURE_WORDS) capture_stop();
+        return;
+    }
+    if (!capture_uploading && capture_resend_chunk < 0) return;
+    if (capture_last_upload_ms != 0 && now - capture_last_upload_ms < CAPTURE_UPLOAD_MS) return;
+    power_touch(POWER_MODEM);
+    if (!Particle.connected()) return;
+    capture_last_upload_ms = now;
+    if (capture_resend_chunk >= 0) {
+        capture_publish(capture_resend_chunk);
+        capture_resend_chunk = -1;
+        return;
+    }
+    capture_publish(capture_next_chunk++);
+    if (capture_next_chunk >= capture_chunks()) capture_uploading = false;
+}
+
+/*
+ * Formats SoC and VCell the way every event has always reported them, e.g. "85.31(%),4.01(V)".
+ */
+void format_pmic_stats(char* buf, size_t size, float soc, float vcell) {
+    snprintf(buf, size, "%.2f(%%),%.2f(V)", soc, vcell);
+}
+
+void format_pmic_stats(char* buf, size_t size) {
+    format_pmic_stats(buf, size, FuelGauge().getSoC(), FuelGauge().getVCell());
+}
+
+/*
+ * Every event starts with the SoC and VCell stats, followed by key=value fields that let the
+ * backend's per-device model (digital twin) apply each event on its own, as it arrives:
+ *   UPDATE  ...,up=<seconds since boot>,seq=<sample sequence number>
+ *   SLEEP n ...,dur=<seconds>,att=<hibernate attempt>,thr=<threshold %>[,plan][,standby]
+ *   WAKE    ...,rr=<reset reason>,wk=<wake reason>,att=<hibernate attempts so far>,pol=<policy version>
+ * @param eventname The event to publish.
+ * @param extra Fields appended after the stats, without the leading comma, or NULL.
+ */
+void publish_pmic_stats_event(const char* eventname, const char* extra = NULL) {
+    char stats[96];
+    format_pmic_stats(stats, sizeof(stats));
+    if (extra != NULL) {
+        size_t len = strlen(stats);
+        snprintf(stats + len, sizeof(stats) - len, ",%s", extra);
+    }
+    trace(TRACE_PUBLISH, eventname[0]);
+    Particle.publish(eventname, stats);
+    #ifdef SERIAL_DEBUGGING
+        MY_SERIAL.printlnf("%s %s", eventname, stats);
+        delay(100);
+    #endif
+}
+
+/*
+ * The newest sample, waiting for the modem to connect when it was gated at sample time.
+ * Older samples that never made it out are resent from the history store.
+ */
+struct pending_update_t {
+    bool pending;
+    float soc;
+    float vcell;
+    uint32_t up;
+    uint32_t seq;
+};
+pending_update_t pending_update;
+
+void publish_update(const pending_update_t& update) {
+    char stats[64];
+    format_pmic_stats(stats, sizeof(stats), update.soc, update.vcell);
+    size_t len = strlen(stats);
+    snprintf(stats + len, sizeof(stats) - len, ",up=%lu,seq=%lu", update.up, update.seq);
+    trace(TRACE_PUBLISH, 'U');
+    Particle.publish("UPDATE", stats);
+    #ifdef SERIAL_DEBUGGING
+        MY_SERIAL.printlnf("UPDATE %s", stats);
+        delay(100);
+    #endif
+}
+
+/*
+ * Takes a sample, numbers it, keeps it in the history store and publishes it as an UPDATE.
+ */
+void publish_pmic_stats(void) {
+    battery_state_t state = battery_state();
+    pending_update_t update = { true, state.soc, state.vcell, millis() / 1000, 0 };
+    update.seq = history_append(update.soc, update.vcell);
+    power_touch(POWER_MODEM);
+    if (Particle.connected()) {
+        publish_update(update);
+        pending_update.pending = false;
+    }
+    else {
+        pending_update = update;
+    }
+}
+
+void pending_update_process() {
+    if (pending_update.pending && Particle.connected()) {
+        pending_update.pending = false;
+        publish_update(pending_update);
+    }
+}
+
+int get_soc(String c) {
+    return (int)(battery_state().soc);
+}
+
+int get_battv(String c) {
+    return (int)(100 * battery_state().vcell);
+}
+
+/*
+ * Network standby - a hibernate in SLEEP_MODE_SOFTPOWEROFF can't be reached from the cloud until
+ * it ends, up to 51.2 hours later.  Close to the threshold the policy can trade some charge for
+ * reachability: stop mode with the modem still registered (SLEEP_NETWORK_STANDBY) wakes on the
+ * modem's ring indicator when cloud traffic arrives, e.g. a "cmd" call from ops.
+ *
+ * Rough cost per device class, from the datasheet figures, not measured on this app:
+ *   soft power off            ~0.13mA  ->  51.2h costs   7mAh (0.3% of 2000mAh)
+ *   stop + 3G modem standby   ~3mA     ->  51.2h costs 154mAh (7.7%)
+ * so waiting for the next timer wake costs ops up to two days of latency while standby costs
+ * about 0.15% SoC per hour.  Standby is only used when the estimated cost still leaves the
+ * battery above STANDBY_FLOOR_SOC at the end of the sleep, otherwise it falls back to power off.
+ */
+const float STANDBY_CURRENT_MA = 3.0;
+const float STANDBY_FLOOR_SOC = 10.0;
+const uint32_t STANDBY_RING_AWAKE_MS = 2*60*1000;   // stay up for the request that woke us
+
+bool sleep_policy_valid(const sleep_policy_t& p) {
+    return p.low_batt_capacity >= LOW_BATT_CAPACITY && p.low_batt_capacity <= MAX_LOW_BATT_CAPACITY
+        && p.backoff_base >= MIN_BACKOFF_BASE && p.backoff_base <= MAX_BACKOFF_BASE
+        && p.backoff_max_exponent <= MAX_BACKOFF_MAX_EXPONENT
+        && (p.standby_soc == 0 || (p.standby_soc > STANDBY_FLOOR_SOC && p.standby_soc < p.low_batt_capacity));
+}
+
+const sleep_policy_t& sleep_policy() {
+    if (policy.magic != POLICY_MAGIC || !sleep_policy_valid(policy)) {
+        policy.magic = POLICY_MAGIC;
+        policy.low_batt_capacity = LOW_BATT_CAPACITY;
+        policy.backoff_base = DEFAULT_BACKOFF_BASE;
+        policy.backoff_max_exponent = DEFAULT_BACKOFF_MAX_EXPONENT;
+        policy.version = 0;
+        policy.standby_soc = 0;
+    }
+    return policy;
+}
+
+/*
+ * Sleep plan - the backend often knows better than sleep_backoff() when a device should next
+ * wake (weather forecast, site maintenance).  While connected it can send a plan with the [P]
+ * command: when to wake, the SoC to hibernate below, and how often to publish.  The plan lives
+ * in retained memory so it survives hibernates, is checksummed and validated on every use, and
+ * the device falls back to its local policy once the plan expires.
+ *
+ *   P <expires in>,<min SoC %>,<publish seconds>,<wake in>[,<wake in>...]
+ *
+ * Times are minutes from now, to fit the 63 character function argument, and are converted to
+ * Time.now() based times on receipt.  Wake times are ascending, at most PLAN_MAX_WAKES of them.
+ * "P 0" cancels the plan.
+ */
+const uint8_t PLAN_MAX_WAKES = 4;
+const uint32_t PLAN_MAGIC = 0x5EE9914A;
+const uint32_t PLAN_MAX_LIFETIME = 30*24*60*60;
+const uint32_t PLAN_MIN_CADENCE = 10;
+const uint32_t PLAN_MAX_CADENCE = 24*60*60;
+const uint32_t PLAN_MAX_SLEEP = 7*24*60*60;
+const uint32_t DEFAULT_PUBLISH_CADENCE = 60;
+
+struct sleep_plan_t {
+    uint32_t magic;
+    uint32_t expiry;            // Time.now() after which the plan is ignored
+    float min_soc;              // hibernate below this (%)
+    uint32_t publish_cadence;   // seconds between UPDATE events
+    uint32_t num_wakes;
+    uint32_t wake_times[PLAN_MAX_WAKES];
+    uint32_t checksum;          // FNV-1a of everything above
+};
+retained sleep_plan_t plan;
+
+static_assert(sizeof(sleep_plan_t) == 4 * (6 + PLAN_MAX_WAKES), "sleep plan must not have padding, it is checksummed");
+
+uint32_t sleep_plan_checksum(const sleep_plan_t& p) {
+    const uint8_t* bytes = (const uint8_t*)&p;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(sleep_plan_t, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * @return The plan if there is a valid, unexpired one, otherwise NULL.
+ */
+const sleep_plan_t* sleep_plan() {
+    if (plan.magic != PLAN_MAGIC || plan.checksum != sleep_plan_checksum(plan)) return NULL;
+    if (!Time.isValid() || Time.now() >= plan.expiry) return NULL;
+    return &plan;
+}
+
+/*
+ * @return Seconds until the plan's next wake time, or 0 to use the local backoff.
+ */
+uint32_t sleep_plan_next_wake() {
+    const sleep_plan_t* p = sleep_plan();
+    if (p == NULL) return 0;
+    uint32_t now = Time.now();
+    for (uint8_t i = 0; i < p->num_wakes; i++) {
+        if (p->wake_times[i] > now) {
+            return min(max(p->wake_times[i] - now, MIN_BACKOFF_BASE), PLAN_MAX_SLEEP);
+        }
+    }
+    return 0;
+}
+
+uint32_t publish_cadence() {
+    const sleep_plan_t* p = sleep_plan();
+    return (p != NULL) ? p->publish_cadence : profile().publish_cadence;
+}
+
+float low_batt_threshold() {
+    const sleep_plan_t* p = sleep_plan();
+    return max((p != NULL) ? p->min_soc : sleep_policy().low_batt_capacity, profile().threshold_floor);
+}
+
+/*
+ * Battery usage counters for maintenance planning - how hard is this battery being worked?
+ * - Equivalent full cycles: every 1% of SoC discharged counts as 0.01 cycle.  A reference level
+ *   only moves up after a real rise, so gauge noise isn't counted over and over.
+ * - Depth of discharge histogram: each discharge (from a peak until SoC rises again) is counted
+ *   in a 10% wide bin by how deep it went.
+ * - Time spent below the hibernate threshold, including time spent hibernating.
+ * - The largest SoC drop between two batt_monitor checks since the last DIAG publish.  Once that
+ *   gets close to the 10% margin explained above batt_monitor, the battery can no longer survive
+ *   the worst case interval between checks and should be replaced.
+ * - Connect sag: how far VCell drops from rest once the modem is connected.  At the same load,
+ *   this grows with the battery's internal resistance, so its trend shows the battery aging.
+ * - Discharge and charge rates (%/hour): one signed rate, smoothed over the recent samples and
+ *   split by its sign when reported.  Each sample spans at least USAGE_RATE_SPAN, so the gauge's
+ *   noise between two ticks doesn't swamp a slow drain, and flat samples count too.  These are
+ *   the features the backend clusters devices by, to pick a sleep policy for each cluster.
+ * Kept in retained memory and updated with O(1) work per sample.  The host side fits trends of
+ * these per device to forecast when each battery needs replacing.
+ */
+const float USAGE_HYSTERESIS = 0.5;       // (%) rise that ends a discharge
+const uint8_t USAGE_DOD_BINS = 10;
+const float USAGE_RATE_ALPHA = 0.05;      // EWMA weight of each sample's rate
+const uint32_t USAGE_RATE_SPAN = 30*60;   // seconds each rate sample spans
+const uint32_t USAGE_RATE_MAX_GAP = 60*60; // don't compute a rate across a hibernate
+const uint32_t USAGE_MAGIC = 0xBA77C1C4;
+
+struct battery_usage_t {
+    uint32_t magic;
+    float cycles;           // equivalent full cycles
+    float ref_soc;          // level discharge is counted from
+    float peak_soc;         // SoC at the start of the current discharge
+    uint32_t last_time;     // Time.now() of the last sample
+    uint32_t secs_below_low;
+    uint16_t dod_histogram[USAGE_DOD_BINS];
+    float last_check_soc;   // SoC at the last batt_monitor check
+    float check_drop_max;   // (%) largest drop between checks since the last DIAG
+    uint16_t sag_mv;        // VCell rest minus connected, measured at the last boot
+    float rate_soc;         // SoC at the start of the current rate sample
+    uint32_t rate_time;     // Time.now() of that
+    float rate;             // (%/h) EWMA, negative while discharging
+};
+retained battery_usage_t usage;
+
+void usage_init(float soc) {
+    if (usage.magic != USAGE_MAGIC) {
+        memset(&usage, 0, sizeof(usage));
+        usage.magic = USAGE_MAGIC;
+        usage.ref_soc = usage.peak_soc = usage.last_check_soc = usage.rate_soc = soc;
+        usage.last_time = usage.rate_time = Time.now();
+    }
+}
+
+void usage_update(float soc) {
+    uint32_t now = Time.now();
+    usage_init(soc);
+    if (soc < usage.ref_soc) {
+        usage.cycles += (usage.ref_soc - soc) / 100.0;
+        usage.ref_soc = soc;
+    }
+    else if (soc > usage.ref_soc + USAGE_HYSTERESIS) {
+        // The discharge from peak_soc down to ref_soc is over
+        float dod = usage.peak_soc - usage.ref_soc;
+        if (dod >= USAGE_HYSTERESIS) {
+            uint8_t bin = min((int)(dod / (100 / USAGE_DOD_BINS)), USAGE_DOD_BINS - 1);
+            if (usage.dod_histogram[bin] < UINT16_MAX) usage.dod_histogram[bin]++;
+        }
+        usage.ref_soc = usage.peak_soc = soc;
+    }
+    if (soc > usage.peak_soc && soc > usage.ref_soc) {
+        usage.ref_soc = usage.peak_soc = soc;   // still charging
+    }
+    if (now < usage.last_time || now - usage.last_time > USAGE_RATE_MAX_GAP || now < usage.rate_time) {
+        usage.rate_soc = soc;   // start over after a hibernate or a clock step
+        usage.rate_time = now;
+    }
+    else if (now - usage.rate_time >= USAGE_RATE_SPAN) {
+        float rate = (soc - usage.rate_soc) * 3600.0 / (now - usage.rate_time);
+        usage.rate += USAGE_RATE_ALPHA * (rate - usage.rate);
+        usage.rate_soc = soc;
+        usage.rate_time = now;
+    }
+    if (soc < low_batt_threshold() && now > usage.last_time) {
+        usage.secs_below_low += now - usage.last_time;
+    }
+    usage.last_time = now;
+}
+
+float usage_discharge_rate() {
+    return max(0.0f, -usage.rate);
+}
+
+float usage_charge_rate() {
+    return max(0.0f, usage.rate);
+}
+
+void usage_check(float soc) {
+    usage_init(soc);
+    usage.check_drop_max = max(usage.check_drop_max, usage.last_check_soc - soc);
+    usage.last_check_soc = soc;
+}
+
+/*
+ * @param rest_vcell VCell before the modem was powered.
+ * @param connected_vcell VCell with the modem connected.
+ */
+void usage_sag(float rest_vcell, float connected_vcell) {
+    usage.sag_mv = max(0, (int)((rest_vcell - connected_vcell) * 1000 + 0.5));
+}
+
+/*
+ * e.g. "cyc=12.34,low=3600,dod=3/1/0/0/2/0/0/0/0/0,wcd=2.10,sag=85,dis=3.10,chg=12.50,pol=2"
+ */
+void format_usage(char* buf, size_t size) {
+    int len = snprintf(buf, size, "cyc=%.2f,low=%lu,dod=", usage.cycles, usage.secs_below_low);
+    for (uint8_t i = 0; i < USAGE_DOD_BINS && len < (int)size; i++) {
+        len += snprintf(buf + len, size - len, (i == 0) ? "%u" : "/%u", usage.dod_histogram[i]);
+    }
+    if (len < (int)size) {
+        snprintf(buf + len, size - len, ",wcd=%.2f,sag=%u,dis=%.2f,chg=%.2f,pol=%u",
+                usage.check_drop_max, usage.sag_mv, usage_discharge_rate(), usage_charge_rate(), sleep_policy().version);
+    }
+}
+
+/*
+ * Wake on charger - SLEEP_MODE_SOFTPOWEROFF wakes on the RTC or on a rising edge on WKP.  The
+ * PMIC's power-good/charge interrupt is routed to LOW_BAT_UC, which can't wake the STM32 from
+ * standby, so the charger's power-good has to be tied to WKP (e.g. a divider from VIN) to end
+ * a hibernate as soon as USB or a panel shows up.  The RTC time the hibernate should have ended
+ * is retained, so setup() can tell a timer wake from an early one, and early with power good
+ * is a charger wake.
+ *
+ * With a charger connected the hibernate check lets the device stay awake below the threshold,
+ * as long as SoC isn't still falling between checks (a weak panel can't carry the awake load)
+ * and VCell is clear of brownout.  Unplugged, the next batt_monitor check hibernates again.
+ */
+enum wake_reason_t {
+    WAKE_COLD,      // reset, power up, anything but the end of a hibernate
+    WAKE_TIMER,
+    WAKE_CHARGER,
+    WAKE_EARLY,     // WKP without power good
+    WAKE_RING,      // cloud traffic during network standby
+};
+const char* const wake_reason_names[] = { "cold", "timer", "charger", "early", "ring" };
+
+retained uint32_t sleep_wake_at;    // RTC time the current hibernate ends, only valid after one
+uint8_t wake_reason = WAKE_COLD;
+const uint32_t WAKE_TIMER_SLACK = 60;       // seconds, RTC wakes are a little early at times
+const float CHARGER_RESUME_VCELL = 3.50;
+
+bool charger_connected() {
+    return PMIC().isPowerGood();
+}
+
+uint8_t classify_wake() {
+    if (System.resetReason() != RESET_REASON_POWER_MANAGEMENT) return WAKE_COLD;
+    if (!Time.isValid() || Time.now() + WAKE_TIMER_SLACK >= sleep_wake_at) return WAKE_TIMER;
+    return charger_connected() ? WAKE_CHARGER : WAKE_EARLY;
+}
+
+/*
+ * Sleep bandit - sites recover from a low battery at very different rates, so instead of one
+ * sleep_backoff() curve every device learns which hibernate duration works for it.  The arms are
+ * backoff_base * 2^k, k up to the policy's max exponent.  A hibernate on an arm succeeds when the
+ * check after its timer wake finds SoC back above the threshold, and is wasted otherwise.
+ * Each arm keeps Beta(1 + resumed, 1 + wasted) counts, halved once they pass BANDIT_MEMORY so a
+ * changing season is picked up.  Thompson sampling draws a resume probability p per arm and
+ * picks the arm with the shortest expected time to a resume, (duration + wake cost) / p, where a
+ * wasted wake's energy (connecting and publishing, ~4mAh) is counted as BANDIT_WAKE_COST of dark
+ * time, about what a weak panel needs to put it back.
+ * Wakes that say nothing about the duration (charger, reset, a ring during standby) and sleep
+ * plans aren't counted.  The bandit is off until [B] 1 turns it on, SLEEP's att= then counts
+ * hibernates on the learned arms instead of backoff steps.  [B] shows the arms, turns the bandit
+ * off (back to sleep_backoff()) or resets it.  Everything lives in retained memory, ~40 bytes.
+ */
+const uint32_t BANDIT_MAGIC = 0xBA4D1702;    // bumped when the default went to off
+const uint8_t BANDIT_ARMS = MAX_BACKOFF_MAX_EXPONENT + 1;
+const uint8_t BANDIT_MEMORY = 24;
+const uint32_t BANDIT_WAKE_COST = 10*60;    // seconds
+const uint8_t BANDIT_NONE = 0xFF;
+
+struct bandit_arm_t {
+    uint8_t resumed;
+    uint8_t wasted;
+};
+
+struct sleep_bandit_t {
+    uint32_t magic;
+    uint32_t rng;               // xorshift32 state
+    uint8_t enabled;
+    uint8_t pending;            // arm of the hibernate in progress, BANDIT_NONE if none
+    uint16_t reserved;
+    uint32_t wakes;
+    uint32_t wasted;
+    bandit_arm_t arms[BANDIT_ARMS];
+};
+retained sleep_bandit_t bandit;
+
+void bandit_init() {
+    if (bandit.magic == BANDIT_MAGIC) return;
+    memset(&bandit, 0, sizeof(bandit));
+    bandit.magic = BANDIT_MAGIC;
+    bandit.enabled = false;    // opt in with [B] 1, the header's backoff curve is the default
+    bandit.pending = BANDIT_NONE;
+    bandit.rng = micros() ^ Time.now();
+}
+
+float bandit_uniform() {
+    uint32_t x = bandit.rng ? bandit.rng : 0x9E3779B9;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bandit.rng = x;
+    return (x >> 8) * (1.0f / 16777216.0f) + (0.5f / 16777216.0f);   // (0, 1)
+}
+
+/*
+ * Gamma(k, 1) for a whole number k, as a sum of k exponentials.
+ */
+float bandit_gamma(uint8_t k) {
+    float sum = 0;
+    for (uint8_t i = 0; i < k; i++) sum -= logf(bandit_uniform());
+    return sum;
+}
+
+float bandit_sample(const bandit_arm_t& arm) {
+    float x = bandit_gamma(1 + arm.resumed);
+    float y = bandit_gamma(1 + arm.wasted);
+    return x / (x + y);
+}
+
+/*
+ * @return The exponent to hibernate backoff_base * 2^exponent, and remembers it for the outcome.
+ */
+uint8_t bandit_choose(uint8_t max_exponent, uint32_t base) {
+    bandit_init();
+    uint8_t best = 0;
+    float best_time = 0;
+    for (uint8_t k = 0; k <= max_exponent && k < BANDIT_ARMS; k++) {
+        float expected = ((base << k) + BANDIT_WAKE_COST) / bandit_sample(bandit.arms[k]);
+        if (k == 0 || expected < best_time) {
+            best = k;
+            best_time = expected;
+        }
+    }
+    bandit.pending = best;
+    return best;
+}
+
+/*
+ * The first hibernate check after a timer wake decides how the last hibernate went.
+ */
+void bandit_outcome(bool resumed) {
+    bandit_init();
+    if (bandit.pending >= BANDIT_ARMS) return;
+    bandit_arm_t& arm = bandit.arms[bandit.pending];
+    bandit.pending = BANDIT_NONE;
+    bandit.wakes++;
+    if (resumed) arm.resumed++;
+    else {
+        arm.wasted++;
+        bandit.wasted++;
+    }
+    if (arm.resumed + arm.wasted > BANDIT_MEMORY) {
+        arm.resumed = (arm.resumed + 1) / 2;
+        arm.wasted = (arm.wasted + 1) / 2;
+    }
+}
+
+void bandit_wake(uint8_t reason) {
+    bandit_init();
+    if (reason != WAKE_TIMER) bandit.pending = BANDIT_NONE;
+}
+
+/*
+ * Standby only when the policy allows it at this SoC and the estimated standby cost still ends
+ * above STANDBY_FLOOR_SOC.  The modem has to be registered already to stay reachable.
+ */
+bool standby_affordable(float soc, uint32_t sleep_time) {
+    const sleep_policy_t& p = sleep_policy();
+    if (p.standby_soc == 0 || soc < p.standby_soc || !Particle.connected()) return false;
+    float cost = 100.0 * STANDBY_CURRENT_MA * sleep_time / 3600.0 / NOMINAL_CAPACITY_MAH;
+    return soc - cost >= STANDBY_FLOOR_SOC;
+}
+
+/*
+ * Stop mode returns here instead of resetting.  A ring wake stays up for a while so the request
+ * that woke us gets served, then loop() checks the battery again.
+ */
+bool standby_hold = false;
+uint32_t standby_woke_ms = 0;
+uint32_t standby_hold_ms = 0;
+
+void standby_resume(bool ring) {
+    wake_reason = ring ? WAKE_RING : WAKE_TIMER;
+    trace(TRACE_WAKE, wake_reason);
+    bandit_wake(wake_reason);
+    standby_hold = true;
+    standby_woke_ms = millis();
+    standby_hold_ms = ring ? STANDBY_RING_AWAKE_MS : 0;
+    power_touch(POWER_MODEM);
+    if (Particle.connected()) {
+        char extra[64];
+        snprintf(extra, sizeof(extra), "rr=%d,wk=%s,att=%lu,pol=%u", RESET_REASON_NONE,
+                wake_reason_names[wake_reason], low_batt_sleep_attempts, sleep_policy().version);
+        publish_pmic_stats_event("WAKE", extra);
+    }
+}
+
+/*
+ * @param soc_drop how much SoC went down since the last hibernate check
+ */
+bool resume_on_charger(float soc_drop) {
+    return charger_connected() && soc_drop <= 0.5 && FuelGauge().getVCell() >= CHARGER_RESUME_VCELL;
+}
+
+/*
+ * Hibernate state machine - batt_monitor, the [b] command (loop() or the system thread for
+ * the cloud) and setup() all ask for the same check.  Asking only moves the state from idle
+ * to requested with an atomic compare-and-swap, so asking again while a check is pending is
+ * a no-op.  loop() is the only place the check runs, so low_batt_sleep_attempts is
+ * never updated from two threads, and the device can't publish and sleep twice at once.
+ *
+ *   IDLE --request--> REQUESTED --loop()--> CHECKING --> IDLE
+ *                                                    \--> SLEEPING (doesn't come back)
+ */
+enum hibernate_state_t {
+    HIBERNATE_IDLE,
+    HIBERNATE_REQUESTED,
+    HIBERNATE_CHECKING,
+    HIBERNATE_SLEEPING,
+};
+std::atomic<uint8_t> hibernate_state(HIBERNATE_IDLE);
+
+/*
+ * Safe to call from any thread.
+ * @return `false` if a check was already pending or running.
+ */
+bool request_hibernate_check() {
+    uint8_t expected = HIBERNATE_IDLE;
+    return hibernate_state.compare_exchange_strong(expected, HIBERNATE_REQUESTED);
+}
+
+/*
+ * Make sure we are at minimum hibernating the system for long enough to charge up past 30%
+ * battery capacity.  If we normally charge at a 512mA average with the supplied 2000mAh battery,
+ * a 512mA charging rate would ideally charge the battery within 2*60 minutes for 100% of the
+ * battery(it's more like 2.5 hours due to the top off phase, but we can just consider the bulk
+ * constant current charge rate), or 120/10 for 10% of the battery.  Be safe and go with double
+ * that, or 24 minutes.
+ */
+void qualify_battery_and_hibernate() {
+    float soc = FuelGauge().getSoC();
+    usage_init(soc);
+    float soc_drop = usage.last_check_soc - soc;
+    usage_check(soc);
+    bool low = battery_lower_than(low_batt_threshold());
+    bandit_outcome(!low);
+    if (low && !resume_on_charger(soc_drop)) {
+        const sleep_policy_t& p = sleep_policy();
+        uint32_t sleep_time;
+        ++low_batt_sleep_attempts;
+        if (bandit.enabled) sleep_time = p.backoff_base << bandit_choose(p.backoff_max_exponent, p.backoff_base);
+        else sleep_time = p.backoff_base * (sleep_backoff(low_batt_sleep_attempts, p.backoff_max_exponent) / 1000);
+        uint32_t planned = sleep_plan_next_wake();
+        if (planned != 0) {
+            sleep_time = planned;
+            bandit.pending = BANDIT_NONE;
+        }
+        bool standby = standby_affordable(soc, sleep_time);
+        char eventname[24];
+        snprintf(eventname, sizeof(eventname), "SLEEP %lu", sleep_time);
+        if (Particle.connected()) {
+            char extra[64];
+            snprintf(extra, sizeof(extra), "dur=%lu,att=%lu,thr=%.1f%s%s", sleep_time, low_batt_sleep_attempts,
+                    low_batt_threshold(), (planned != 0) ? ",plan" : "", standby ? ",standby" : "");
+            publish_pmic_stats_event(eventname, extra);
+            delay(5000); // should not need this after 0.6.1 is released
+        }
+        #ifdef SERIAL_DEBUGGING
+            char stats[32];
+            format_pmic_stats(stats, sizeof(stats));
+            MY_SERIAL.printlnf("%s %s", eventname, stats);
+            delay(100);
+        #endif
+        trace(TRACE_SLEEP, standby);
+        if (standby) {
+            uint32_t start = Time.now();
+            System.sleep(RI_UC, FALLING, sleep_time, SLEEP_NETWORK_STANDBY);
+            standby_resume(Time.now() - start < sleep_time - WAKE_TIMER_SLACK);
+            return; // still counts as a hibernate attempt
+        }
+        hibernate_state = HIBERNATE_SLEEPING;
+        sleep_wake_at = Time.now() + sleep_time;
+        System.sleep(SLEEP_MODE_SOFTPOWEROFF, sleep_time);
+    }
+    low_batt_sleep_attempts = 0; // reset if we don't hibernate
+}
+
+/*
+ * Make sure we are polling the battery capacity with enough frequency to ensure it doesn't get to 10%.
+ * If our threshold is 20%, then we need to be polling at least as frequently as it takes to go from
+ * 20% to 10% during the worst case load.  Let's assume 250mA average with the supplied 2000mAh battery.
+ * A 0.2C discharge rate (400mA) should last 5*60 minutes per battery spec, so 250mA should last 8*60 minutes
+ * for 100% of the battery, or 480/10 for 10% of the battery.  Be safe and go with half, or 24 minutes.
+ */
+const uint32_t BATT_MONITOR_PERIOD = 24*60;    // seconds
+
+void batt_monitor_tick() {
+    if (standby_hold) return; // standby_process() checks once the hold is over
+    request_hibernate_check();
+}
+
+void standby_process() {
+    if (standby_hold && millis() - standby_woke_ms >= standby_hold_ms && request_hibernate_check()) {
+        standby_hold = false;
+    }
+}
+
+/*
+ * Runs a requested hibernate check, only ever from loop() (or setup() before the scheduler starts).
+ */
+void hibernate_process() {
+    uint8_t expected = HIBERNATE_REQUESTED;
+    if (!hibernate_state.compare_exchange_strong(expected, HIBERNATE_CHECKING)) return;
+    qualify_battery_and_hibernate();
+    hibernate_state = HIBERNATE_IDLE;
+}
+
+/*
+ * Publish data every minute to give the Electron a test workout, and the usage counters
+ * once an hour as a "DIAG" event.
+ */
+const uint32_t DIAG_PERIOD = 60*60;    // seconds
+
+void publish_data_tick() {
+    usage_update(battery_state().soc);
+    publish_pmic_stats();
+}
+
+/*
+ * DIAG waits for the modem to connect when it was gated at the slot, and check_drop_max only
+ * starts over once a DIAG carrying it went out.
+ */
+const uint32_t DIAG_RETRY_MS = 10*1000;
+bool diag_pending = false;
+uint32_t diag_last_try = 0;
+
+void publish_diag() {
+    diag_pending = true;
+    power_touch(POWER_MODEM);
+}
+
+void diag_process() {
+    if (!diag_pending) return;
+    power_touch(POWER_MODEM);
+    if (!Particle.connected() || (diag_last_try != 0 && millis() - diag_last_try < DIAG_RETRY_MS)) return;
+    diag_last_try = millis();
+    char diag[128];
+    format_usage(diag, sizeof(diag));
+    trace(TRACE_PUBLISH, 'D');
+    if (Particle.publish("DIAG", diag)) {
+        usage.check_drop_max = 0;
+        diag_pending = false;
+        diag_last_try = 0;
+    }
+}
+
+/*
+ * Daily distribution sketches - per minute samples are too much data and daily averages hide the
+ * transmit sag minima that come before a brownout.  Every battery poll goes into a fixed-bin
+ * histogram per signal plus Welford's running mean/variance and the exact min/max, kept in
+ * retained memory (~280 bytes) and published once a day, then cleared:
+ *   SKETCH s|v,<period start>,<n>,<mean>,<sd>,<min>,<max>,<base64 uint16 bin counts, little endian>
+ * Fixed bins merge exactly: the host adds bin counts across devices and days, and combines the
+ * moments with the parallel variance formula.  Quantiles come out to a bin width, 2% of SoC and
+ * 25mV of VCell, see [k].  Bin counts saturate at 65535, ~7 days of 10 second polls.
+ * When the modem is gated at the slot the sketch waits for it to connect (and keeps adding up),
+ * and it is only cleared once both events went out.
+ */
+const uint32_t SKETCH_MAGIC = 0x5CE7C401;
+const uint32_t SKETCH_PERIOD = 24*60*60;    // seconds
+const uint8_t SKETCH_SOC_BINS = 50;         // 2% each
+const uint8_t SKETCH_MV_BINS = 64;          // 25mV each
+const uint16_t SKETCH_MV_MIN = 3000;
+const uint16_t SKETCH_MV_STEP = 25;
+
+struct sketch_stats_t {
+    uint32_t n;
+    float mean;
+    float m2;               // sum of squared differences from the mean
+    float min;
+    float max;
+};
+
+struct battery_sketch_t {
+    uint32_t magic;
+    uint32_t start;         // Time.now() the period started
+    sketch_stats_t soc;
+    sketch_stats_t mv;
+    uint16_t soc_bins[SKETCH_SOC_BINS];
+    uint16_t mv_bins[SKETCH_MV_BINS];
+};
+retained battery_sketch_t sketch;
+
+void sketch_clear() {
+    memset(&sketch, 0, sizeof(sketch));
+    sketch.magic = SKETCH_MAGIC;
+    sketch.start = Time.now();
+}
+
+void sketch_stats_add(sketch_stats_t& st, float x) {
+    st.n++;
+    float delta = x - st.mean;
+    st.mean += delta / st.n;
+    st.m2 += delta * (x - st.mean);
+    if (st.n == 1 || x < st.min) st.min = x;
+    if (st.n == 1 || x > st.max) st.max = x;
+}
+
+float sketch_stats_sd(const sketch_stats_t& st) {
+    return (st.n > 1) ? sqrtf(st.m2 / (st.n - 1)) : 0;
+}
+
+void sketch_bin_add(uint16_t* bins, int bin, int num_bins) {
+    bin = min(max(bin, 0), num_bins - 1);
+    if (bins[bin] < 0xFFFF) bins[bin]++;
+}
+
+/*
+ * From battery_state_poll(), the only writer.
+ */
+void sketch_add(float soc, float vcell) {
+    if (sketch.magic != SKETCH_MAGIC) sketch_clear();
+    float mv = vcell * 1000;
+    sketch_stats_add(sketch.soc, soc);
+    sketch_stats_add(sketch.mv, mv);
+    sketch_bin_add(sketch.soc_bins, (int)(soc / (100 / SKETCH_SOC_BINS)), SKETCH_SOC_BINS);
+    sketch_bin_add(sketch.mv_bins, (int)((mv - SKETCH_MV_MIN) / SKETCH_MV_STEP), SKETCH_MV_BINS);
+}
+
+/*
+ * The value below which a fraction q of the samples fall, interpolated within its bin.
+ */
+float sketch_quantile(const uint16_t* bins, uint8_t num_bins, float lo, float width, float q) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < num_bins; i++) total += bins[i];
+    if (total == 0) return 0;
+    float target = q * total;
+    uint32_t below = 0;
+    for (uint8_t i = 0; i < num_bins; i++) {
+        if (bins[i] > 0 && below + bins[i] >= target) {
+            return lo + width * (i + (target - below) / bins[i]);
+        }
+        below += bins[i];
+    }
+    return lo + width * num_bins;
+}
+
+bool sketch_publish_one(char signal, const sketch_stats_t& st, const uint16_t* bins, uint8_t num_bins) {
+    char event[255];
+    int len = snprintf(event, sizeof(event), "%c,%lu,%lu,%.1f,%.1f,%.1f,%.1f,", signal, sketch.start, st.n,
+            st.mean, sketch_stats_sd(st), st.min, st.max);
+    base64_encode((const uint8_t*)bins, num_bins * sizeof(bins[0]), event + len, sizeof(event) - len);
+    trace(TRACE_PUBLISH, 'K');
+    return Particle.publish("SKETCH", event);
+}
+
+bool sketch_pending = false;
+bool sketch_soc_sent = false;       // 's' went out, only 'v' is left
+uint32_t sketch_last_try = 0;
+
+void publish_sketch() {
+    sketch_pending = true;
+    power_touch(POWER_MODEM);
+}
+
+void sketch_process() {
+    if (!sketch_pending) return;
+    if (sketch.magic != SKETCH_MAGIC || sketch.soc.n == 0) {
+        sketch_pending = false;
+        return;
+    }
+    power_touch(POWER_MODEM);
+    if (!Particle.connected() || (sketch_last_try != 0 && millis() - sketch_last_try < DIAG_RETRY_MS)) return;
+    sketch_last_try = millis();
+    if (!sketch_soc_sent) sketch_soc_sent = sketch_publish_one('s', sketch.soc, sketch.soc_bins, SKETCH_SOC_BINS);
+    if (sketch_soc_sent && sketch_publish_one('v', sketch.mv, sketch.mv_bins, SKETCH_MV_BINS)) {
+        sketch_clear();
+        sketch_pending = false;
+        sketch_soc_sent = false;
+        sketch_last_try = 0;
+    }
+}
+
+/*
+ * Scheduler - periodic work runs from loop() at absolute deadlines on a grid aligned to the
+ * RTC (e.g. every UPDATE on the minute), instead of Timers that restart their period when
+ * the callback finishes.  Blocking delays in a task only make that one run late, they don't
+ * shift every sample after it, so telemetry from the whole fleet lines up on the server.
+ *
+ * Until the RTC has been set by the cloud the grid is based on uptime, and it's re-aligned
+ * once the RTC becomes valid or steps.  A step is the schedule clock moving more than
+ * SCHEDULE_STEP_SLACK away from what millis() says has passed, forward or back.  When a task misses slots (loop() blocked, or a long
+ * characterization step), SLOT_SKIP runs it once and drops the missed slots, SLOT_CATCH_UP runs
+ * it once per missed slot on the following loop() passes, up to SCHEDULE_MAX_CATCH_UP.
+ * Lateness against the deadline is added up per task as drift, see the [S] command.
+ */
+enum slot_policy_t {
+    SLOT_SKIP,
+    SLOT_CATCH_UP,
+};
+
+struct scheduled_task_t {
+    const char* name;
+    void (*run)();
+    uint32_t period;        // seconds
+    uint8_t policy;
+    bool enabled;
+    uint32_t deadline;      // next slot, on the schedule clock
+    uint32_t runs;
+    uint32_t skipped;       // slots dropped
+    uint32_t drift_total;   // seconds late, summed over all runs
+    uint32_t drift_max;
+};
+
+enum scheduled_task_id_t {
+    TASK_BATT_MONITOR,
+    TASK_PUBLISH,
+    TASK_DIAG,
+    TASK_SKETCH,
+    NUM_TASKS
+};
+
+scheduled_task_t tasks[NUM_TASKS] = {
+    { "batt_monitor", batt_monitor_tick, BATT_MONITOR_PERIOD, SLOT_SKIP, true },
+    { "publish_data", publish_data_tick, DEFAULT_PUBLISH_CADENCE, SLOT_SKIP, true }, // Optional, this drains the battery for testing and also uses data
+    { "diag", publish_diag, DIAG_PERIOD, SLOT_CATCH_UP, true },
+    { "sketch", publish_sketch, SKETCH_PERIOD, SLOT_SKIP, true },
+};
+
+const uint32_t SCHEDULE_MAX_CATCH_UP = 3;
+const uint32_t SCHEDULE_STEP_SLACK = 5;     // seconds
+uint32_t schedule_last_clock = 0;
+uint32_t schedule_last_ms = 0;
+bool schedule_started = false;
+bool schedule_on_rtc = false;
+
+uint32_t schedule_clock() {
+    return schedule_on_rtc ? Time.now() : millis() / 1000;
+}
+
+void schedule_align(scheduled_task_t& task, uint32_t now) {
+    task.deadline = (now / task.period + 1) * task.period;
+}
+
+void schedule_align_all() {
+    schedule_on_rtc = Time.isValid();
+    uint32_t now = schedule_clock();
+    for (uint8_t i = 0; i < NUM_TASKS; i++) {
+        schedule_align(tasks[i], now);
+    }
+    schedule_last_clock = now;
+    schedule_last_ms = millis();
+}
+
+/*
+ * @return `true` if the schedule clock jumped since the last call, instead of running on.
+ */
+bool schedule_clock_stepped(uint32_t now) {
+    uint32_t expected = schedule_last_clock + (millis() - schedule_last_ms) / 1000;
+    schedule_last_clock = now;
+    schedule_last_ms = millis();
+    return (now > expected + SCHEDULE_STEP_SLACK) || (now + SCHEDULE_STEP_SLACK < expected);
+}
+
+void schedule_start() {
+    schedule_align_all();
+    schedule_started = true;
+}
+
+void schedule_enable(uint8_t id, bool enabled) {
+    if (enabled && !tasks[id].enabled) schedule_align(tasks[id], schedule_clock());
+    tasks[id].enabled = enabled;
+}
+
+void schedule_set_period(uint8_t id, uint32_t period) {
+    if (tasks[id].period == period) return;
+    tasks[id].period = period;
+    schedule_align(tasks[id], schedule_clock());
+}
+
+/*
+ * Runs each task that's due at most once per call, from loop().
+ */
+void schedule_process() {
+    if (!schedule_started) return;
+    if (Time.isValid() != schedule_on_rtc || schedule_clock_stepped(schedule_clock())) schedule_align_all();
+    schedule_set_period(TASK_PUBLISH, publish_cadence()); // follow the sleep plan
+
+    uint32_t now = schedule_clock();
+    for (uint8_t i = 0; i < NUM_TASKS; i++) {
+        scheduled_task_t& task = tasks[i];
+        if (!task.enabled) continue;
+        if (task.deadline > now + task.period) {
+            schedule_align(task, now); // clock stepped back
+            continue;
+        }
+        if (now < task.deadline) continue;
+
+        uint32_t missed = (now - task.deadline) / task.period;
+        uint32_t allowed = (task.policy == SLOT_CATCH_UP) ? SCHEDULE_MAX_CATCH_UP : 0;
+        if (missed > allowed) {
+            task.skipped += missed - allowed;
+            task.deadline += (missed - allowed) * task.period;
+        }
+        uint32_t late = now - task.deadline;
+        task.drift_total += late;
+        task.drift_max = max(task.drift_max, late);
+        task.runs++;
+        task.deadline += task.period;
+        trace(TRACE_TASK, i);
+        trace_log.active_task = i;
+        task.run();
+        trace_log.active_task = TRACE_NO_TASK;
+    }
+}
+
+/*
+ * Crash capture - Device OS owns the fault handlers.  A hard fault, failed allocation or stack
+ * overflow blinks SOS and resets with RESET_REASON_PANIC and the panic code in resetReasonData(),
+ * so the fault registers and the faulting stack never reach the app.  What it does keep is the
+ * trace log: after a panic or watchdog reset, setup() copies it into the crash record along
+ * with the reset reason, and it's published once as
+ *   CRASH rr=<reset reason>,d=<panic code>,task=<task running>,up=<s>,heap=<free>,n=<crashes>,tr=<events>
+ * where tr is the trace events, oldest first, base64 encoded little endian words.
+ *
+ * Crashes are counted until the app stays up for CRASH_HEALTHY_UPTIME and the CRASH carrying
+ * the count went out.  From CRASH_LOOP_LIMIT on setup() powers off before the modem comes up,
+ * for twice as long each time, so a crash loop doesn't drain the battery through cellular
+ * reconnects.  Every backoff allows one more try.
+ */
+const uint32_t CRASH_MAGIC = 0xC4A5E001;
+const uint32_t CRASH_LOOP_LIMIT = 3;
+const uint32_t CRASH_BACKOFF_BASE = 15*60;          // seconds
+const uint32_t CRASH_BACKOFF_MAX_EXPONENT = 6;      // 16 hours
+const uint32_t CRASH_HEALTHY_UPTIME = 30*60;        // seconds
+
+struct crash_record_t {
+    uint32_t magic;
+    int32_t reason;
+    uint32_t data;
+    uint32_t time;          // RTC, 0 if it wasn't set
+    uint32_t count;         // crashes since the app last stayed up for CRASH_HEALTHY_UPTIME
+    uint8_t published;
+    uint8_t backoff;        // powered off for a crash loop, let the next boot try again
+    uint16_t reserved;
+    trace_log_t trace;
+};
+retained crash_record_t crash;
+
+/*
+ * First thing in setup(), before anything is traced for this boot.
+ */
+void crash_capture() {
+    int reason = System.resetReason();
+    if (crash.magic != CRASH_MAGIC) {
+        memset(&crash, 0, sizeof(crash));
+        crash.magic = CRASH_MAGIC;
+        crash.published = true;
+    }
+    if (reason == RESET_REASON_PANIC || reason == RESET_REASON_WATCHDOG) {
+        crash.reason = reason;
+        crash.data = System.resetReasonData();
+        crash.time = Time.isValid() ? Time.now() : 0;
+        crash.count++;
+        crash.published = false;
+        if (trace_log.magic == TRACE_MAGIC) crash.trace = trace_log;
+        else memset(&crash.trace, 0, sizeof(crash.trace));
+    }
+    trace_reset();
+    trace(TRACE_BOOT, reason);
+}
+
+void crash_loop_backoff() {
+    if (crash.count < CRASH_LOOP_LIMIT) return;
+    if (crash.backoff && System.resetReason() == RESET_REASON_POWER_MANAGEMENT) {
+        crash.backoff = false;  // slept it off, one more try
+        return;
+    }
+    uint32_t sleep_time = CRASH_BACKOFF_BASE << min(crash.count - CRASH_LOOP_LIMIT, CRASH_BACKOFF_MAX_EXPONENT);
+    #ifdef SERIAL_DEBUGGING
+        MY_SERIAL.printlnf("CRASH loop: %lu crashes, powering off for %lus", crash.count, sleep_time);
+        delay(100);
+    #endif
+    crash.backoff = true;
+    trace(TRACE_SLEEP, 2);
+    sleep_wake_at = Time.now() + sleep_time;
+    System.sleep(SLEEP_MODE_SOFTPOWEROFF, sleep_time);
+}
+
+const char* crash_task_name(uint8_t id) {
+    return (id < NUM_TASKS) ? tasks[id].name : "none";
+}
+
+/*
+ * Publishes a pending crash record, and forgets old crashes once the app has stayed up.
+ */
+uint32_t crash_last_try = 0;
+
+void crash_process() {
+    if (crash.published) {
+        if (crash.count != 0 && millis() / 1000 >= CRASH_HEALTHY_UPTIME) crash.count = 0;
+        return;
+    }
+    if (!Particle.connected() || (crash_last_try != 0 && millis() - crash_last_try < DIAG_RETRY_MS)) return;
+    crash_last_try = millis();
+    const trace_log_t& t = crash.trace;
+    uint32_t events[TRACE_EVENTS];
+    uint8_t count = min(t.count, TRACE_EVENTS);
+    for (uint8_t i = 0; i < count; i++) {
+        events[i] = t.events[(t.head + TRACE_EVENTS - count + i) % TRACE_EVENTS];
+    }
+    char event[200];
+    int len = snprintf(event, sizeof(event), "rr=%ld,d=%lu,task=%s,up=%lu,heap=%lu,n=%lu,tr=",
+            crash.reason, crash.data, crash_task_name(t.active_task), t.up, t.heap_free, crash.count);
+    base64_encode((const uint8_t*)events, count * sizeof(events[0]), event + len, sizeof(event) - len);
+    crash.published = Particle.publish("CRASH", event);
+}
+
+/*
+ * Time to threshold / time to full - how long until this device hibernates, for ops.  Every
+ * ESTIMATE_SPAN of polls gives one SoC slope (%/h), folded into an EWMA mean and variance, and the
+ * estimate is refreshed from it: the time until low_batt_threshold() while discharging, to 100%
+ * while charging, each with 90% bounds from the slope's spread.  Until a few slopes are in, the
+ * usage counters' long term rate stands in with wide bounds.
+ * The result is cached as text in the "eta" cloud variable, so a query costs nothing:
+ *   tth=<h>,lo=<h>,hi=<h>,ttf=<h>,flo=<h>,fhi=<h>,rate=<%/h>,sd=<%/h>,n=<slopes>
+ * (-1 where it doesn't apply).
+ * The system thread reads it while loop() writes it, hence the block.
+ */
+const uint32_t ESTIMATE_SPAN = 10*60*1000;  // ms, well above the gauge's SoC resolution
+const float ESTIMATE_ALPHA = 0.2;
+const uint8_t ESTIMATE_MIN_SLOPES = 3;
+const float ESTIMATE_Z90 = 1.645;
+const float ESTIMATE_PRIOR_SPREAD = 0.5;    // +-50% while on the usage rates
+
+struct estimate_t {
+    uint32_t anchor_ms;
+    float anchor_soc;
+    float rate;             // %/h, negative while discharging
+    float var;
+    uint16_t slopes;
+};
+estimate_t estimate;
+char eta_text[128] = "tth=-1,lo=-1,hi=-1,ttf=-1,flo=-1,fhi=-1,rate=0,sd=0,n=0";
+
+/*
+ * Hours to go from soc to target at rate %/h, -1 if it isn't heading there.
+ */
+float estimate_hours(float soc, float target, float rate) {
+    if (rate == 0 || (target - soc) / rate < 0) return -1;
+    return (target - soc) / rate;
+}
+
+void estimate_update(float soc) {
+    uint32_t now = millis();
+    if (estimate.anchor_ms == 0) {
+        estimate.anchor_ms = now;
+        estimate.anchor_soc = soc;
+    }
+    else if (now - estimate.anchor_ms >= ESTIMATE_SPAN) {
+        float slope = (soc - estimate.anchor_soc) * 3600000.0 / (now - estimate.anchor_ms);
+        if (estimate.slopes == 0) estimate.rate = slope;
+        float delta = slope - estimate.rate;
+        estimate.rate += ESTIMATE_ALPHA * delta;
+        estimate.var = (1 - ESTIMATE_ALPHA) * (estimate.var + ESTIMATE_ALPHA * delta * delta);
+        if (estimate.slopes < 0xFFFF) estimate.slopes++;
+        estimate.anchor_ms = now;
+        estimate.anchor_soc = soc;
+    }
+    else return;
+
+    float rate = estimate.rate;
+    float spread = ESTIMATE_Z90 * sqrtf(estimate.var);
+    if (estimate.slopes < ESTIMATE_MIN_SLOPES) {
+        rate = usage.rate;
+        spread = ESTIMATE_PRIOR_SPREAD * fabsf(rate);
+    }
+    float threshold = low_batt_threshold();
+    // the bounds come from the fastest and slowest plausible drain, or charge
+    float tth = estimate_hours(soc, threshold, rate);
+    float lo = estimate_hours(soc, threshold, rate - spread);
+    float hi = (rate + spread < 0) ? estimate_hours(soc, threshold, rate + spread) : -1;
+    float ttf = estimate_hours(soc, 100, rate);
+    float flo = estimate_hours(soc, 100, rate + spread);
+    float fhi = (rate - spread > 0) ? estimate_hours(soc, 100, rate - spread) : -1;
+    char text[sizeof(eta_text)];
+    snprintf(text, sizeof(text), "tth=%.1f,lo=%.1f,hi=%.1f,ttf=%.1f,flo=%.1f,fhi=%.1f,rate=%.2f,sd=%.2f,n=%u",
+            tth, (tth < 0) ? -1 : lo, (tth < 0) ? -1 : hi, ttf, (ttf < 0) ? -1 : flo, (ttf < 0) ? -1 : fhi,
+            rate, sqrtf(estimate.var), estimate.slopes);
+    SINGLE_THREADED_BLOCK() {
+        strcpy(eta_text, text);
+    }
+}
+
+/*
+ * loop() refreshes the shared battery state from the fuel gauge every profile().battery_poll_ms.
+ */
+uint32_t battery_last_poll = 0;
+int gauge_version = 0;   // doesn't change, read once in setup()
+
+void battery_state_poll(bool force = false) {
+    if (!force && millis() - battery_last_poll < profile().battery_poll_ms) return;
+    battery_last_poll = millis();
+    battery_state_t state;
+    power_touch(POWER_I2C);
+    state.soc = FuelGauge().getSoC();
+    state.vcell = FuelGauge().getVCell();
+    state.discharge_rate = usage_discharge_rate();
+    state.charge_rate = usage_charge_rate();
+    state.updated = battery_last_poll;
+    battery_state_store(state);
+    sketch_add(state.soc, state.vcell);
+    estimate_update(state.soc);
+}
+
+/*
+ * [M] and setup() post a profile setting, loop() applies it, see power_profile_t.
+ */
+const uint8_t PROFILE_NO_REQUEST = 0xFF;
+std::atomic<uint8_t> profile_requested(PROFILE_NO_REQUEST);
+
+bool profile_setting_valid(uint8_t setting) {
+    return (setting & ~PROFILE_AUTO) < NUM_PROFILES;
+}
+
+void profile_request(uint8_t setting) {
+    profile_requested = setting;
+}
+
+void profile_process() {
+    uint8_t request = profile_requested.exchange(PROFILE_NO_REQUEST);
+    if (request != PROFILE_NO_REQUEST) {
+        profile_setting = request;
+        profile_magic = PROFILE_MAGIC;
+    }
+    if (profile_magic != PROFILE_MAGIC || !profile_setting_valid(profile_setting)) {
+        profile_setting = PROFILE_PRODUCTION;
+        profile_magic = PROFILE_MAGIC;
+    }
+
+    uint8_t id = profile_setting & ~PROFILE_AUTO;
+    if (profile_setting & PROFILE_AUTO) {
+        float soc = battery_state().soc;
+        id = profile_active;
+        if (soc < PROFILE_STORM_SOC) id = PROFILE_STORM_SAVER;
+        else if (soc > PROFILE_CALM_SOC || id != PROFILE_STORM_SAVER) id = PROFILE_PRODUCTION;
+    }
+    if (id == profile_active && request == PROFILE_NO_REQUEST) return;
+    profile_apply(id);
+    trace(TRACE_PROFILE, id);
+    #ifdef SERIAL_DEBUGGING
+        MY_SERIAL.printlnf("Profile: %s%s", profile().name, (profile_setting & PROFILE_AUTO) ? " (auto)" : "");
+    #endif
+}
+/*
+ * Battery characterization mode - validates the assumptions above (250mA average, 0.2C lasting
+ * 5 hours) on the real device.  Starting from a full charge, cycle through a set of controlled
+ * load steps, log SoC/VCell to the history store (uploaded by RESEND, see the seq gap above) and
+ * measure how fast each step drains the battery.  Nothing here measures current directly, so results are reported as %/hour and the
+ * hours it would take that load to drain 100%, plus the average current implied by the nominal
+ * 2000mAh capacity.
+ *
+ * The run stops well before the batt_monitor hibernate threshold, and on anything that looks
+ * wrong (low VCell, bogus gauge reading, charger connected, max duration).  batt_monitor keeps
+ * running as a backstop.
+ */
+const float CHARZ_START_CAPACITY = 95.0;   // only start from (near) full charge
+const float CHARZ_CUTOFF_CAPACITY = 30.0;  // keep well above LOW_BATT_CAPACITY
+const float CHARZ_CUTOFF_VCELL = 3.60;
+const float CHARZ_CHARGING_RISE = 2.0;     // SoC rising this much means a charger is connected
+const uint32_t CHARZ_SAMPLE_MS = 30*1000;
+const uint32_t CHARZ_LOG_MS = 2*60*1000;
+const uint32_t CHARZ_STEP_MS = 30*60*1000;
+const uint32_t CHARZ_MAX_MS = 24*60*60*1000;
 
-const float LOW_BATT_CAPACITY = 20.0; // 20.0 is lowest it should be set at
-#define MY_SERIAL Serial1
-#define SERIAL_DEBUGGING
+enum charz_step_t {
+    CHARZ_MODEM_TX,     // connected and publishing every sample
+    CHARZ_MODEM_IDLE,   // connected, registered but quiet
+    CHARZ_CPU_BUSY,     // modem off, app thread spinning
+    CHARZ_NUM_STEPS
+};
+const char* const charz_step_names[CHARZ_NUM_STEPS] = { "modem tx", "modem idle", "cpu busy" };
 
-uint32_t lastBlink = 0;
+struct charz_result_t {
+    float soc_drop;     // total (%) dropped over all runs of this step
+    uint32_t ms;        // total time spent in this step
+};
 
-using std::min;
+bool charz_active = false;
+volatile bool charz_start_request = false;
+volatile bool charz_stop_request = false;
+uint8_t charz_step = CHARZ_MODEM_TX;
+uint32_t charz_start_ms = 0;
+uint32_t charz_step_start_ms = 0;
+uint32_t charz_last_sample_ms = 0;
+uint32_t charz_last_log_ms = 0;
+float charz_start_soc = 0;
+float charz_step_start_soc = 0;
+float charz_step_min_soc = 0;
+charz_result_t charz_results[CHARZ_NUM_STEPS];
 
-STARTUP(System.enableFeature(FEATURE_RETAINED_MEMORY));
+void charz_enter_step(uint8_t step, float soc) {
+    charz_step = step;
+    charz_step_start_ms = millis();
+    charz_step_start_soc = soc;
+    charz_step_min_soc = soc;
+    if (step == CHARZ_CPU_BUSY) {
+        power_hold_off(POWER_MODEM, true);  // lifted by charz_finish_step()
+    }
+    else {
+        power_acquire(POWER_MODEM);
+    }
+    #ifdef SERIAL_DEBUGGING
+        MY_SERIAL.printlnf("CHARZ step: %s at %.2f(%%)", charz_step_names[step], soc);
+    #endif
+}
 
-/**
- * Series In: 1, 2, 3, 4, 5...n
- * Series Out: 1 (2 times), 2, 4, 8, 16, 32, 64, 128 seconds (3 times each) thereafter
- * @param attempt_num The current attempt number.
- * @return The number of milliseconds to backoff.
+void charz_finish_step(float soc) {
+    if (charz_step == CHARZ_CPU_BUSY) power_hold_off(POWER_MODEM, false);
+    else power_release(POWER_MODEM);
+    charz_result_t& result = charz_results[charz_step];
+    result.soc_drop += charz_step_start_soc - soc;
+    result.ms += millis() - charz_step_start_ms;
+}
+
+bool charz_start() {
+    if (charz_active) return true;
+    float soc = FuelGauge().getSoC();
+    if (soc < CHARZ_START_CAPACITY) {
+        #ifdef SERIAL_DEBUGGING
+            MY_SERIAL.printlnf("CHARZ refused: %.2f(%%) is below %.1f(%%), charge first", soc, CHARZ_START_CAPACITY);
+        #endif
+        return false;
+    }
+    schedule_enable(TASK_PUBLISH, false); // the load steps control all publishing during the run
+    memset(charz_results, 0, sizeof(charz_results));
+    charz_active = true;
+    charz_start_ms = millis();
+    charz_start_soc = soc;
+    charz_last_sample_ms = charz_last_log_ms = 0;
+    charz_enter_step(CHARZ_MODEM_TX, soc);
+    return true;
+}
+
+/*
+ * The CHARZ summary waits here until the modem is connected, so stopping never blocks loop().
  */
-uint32_t sleep_backoff(uint32_t attempt_num)
-{
-    if (attempt_num == 0)
-        return 0;
-    uint32_t exponent = min(7u, attempt_num/3);
-    return 1000*(1<<exponent);
+char charz_summary[160];
+bool charz_summary_pending = false;
+
+void charz_stop(float soc, const char* reason) {
+    charz_finish_step(soc);
+    charz_active = false;
+
+    char* summary = charz_summary;
+    int len = snprintf(summary, sizeof(charz_summary), "%s %.1f-%.1f(%%) %lumin",
+            reason, charz_start_soc, soc, (millis() - charz_start_ms) / 60000);
+    for (uint8_t i = 0; i < CHARZ_NUM_STEPS && len < (int)sizeof(charz_summary); i++) {
+        const charz_result_t& result = charz_results[i];
+        float pct_per_hour = (result.ms > 0) ? result.soc_drop * 3600000.0 / result.ms : 0;
+        len += snprintf(summary + len, sizeof(charz_summary) - len, ",%.2f(%%/h)", pct_per_hour);
+    }
+
+    #ifdef SERIAL_DEBUGGING
+        MY_SERIAL.printlnf("CHARZ done: %s", summary);
+        for (uint8_t i = 0; i < CHARZ_NUM_STEPS; i++) {
+            const charz_result_t& result = charz_results[i];
+            if (result.ms == 0 || result.soc_drop <= 0) continue;
+            float pct_per_hour = result.soc_drop * 3600000.0 / result.ms;
+            MY_SERIAL.printlnf("  %-10s %6.2f(%%/h) %6.2f(h per 100%%) ~%4.0f(mA)",
+                    charz_step_names[i], pct_per_hour, 100.0 / pct_per_hour,
+                    NOMINAL_CAPACITY_MAH * pct_per_hour / 100.0);
+        }
+    #endif
+
+    charz_summary_pending = true;
+    schedule_enable(TASK_PUBLISH, true);
+}
+
+void charz_summary_process() {
+    if (!charz_summary_pending) return;
+    power_touch(POWER_MODEM);
+    if (!Particle.connected()) return;
+    Particle.publish("CHARZ", charz_summary);
+    charz_summary_pending = false;
 }
 
 /*
- * @param capacity The value to compare current battery to.
- * @return If battery is lower than `capacity`, return `true`.
+ * Runs the characterization state machine from loop().  Never blocks, so serial commands
+ * (including the abort) keep working for the whole run.
  */
-bool battery_lower_than(float capacity)
-{
-    return (FuelGauge().getSoC() < capacity) ? 1 : 0;
+void charz_process() {
+    charz_summary_process();
+    if (charz_start_request) {
+        charz_start_request = false;
+        charz_start();
+    }
+    if (!charz_active) {
+        charz_stop_request = false;
+        return;
+    }
+
+    uint32_t now = millis();
+    if (charz_last_sample_ms != 0 && now - charz_last_sample_ms < CHARZ_SAMPLE_MS && !charz_stop_request) {
+        if (charz_step == CHARZ_CPU_BUSY) {
+            // Keep the CPU busy between samples without starving the rest of loop()
+            volatile uint32_t spin = 0;
+            uint32_t spin_start = micros();
+            while (micros() - spin_start < 20000) spin++;
+        }
+        return;
+    }
+    charz_last_sample_ms = now;
+
+    float soc = FuelGauge().getSoC();
+    float vcell = FuelGauge().getVCell();
+    if (charz_last_log_ms == 0 || now - charz_last_log_ms >= CHARZ_LOG_MS) {
+        charz_last_log_ms = now;
+        history_append(soc, vcell);
+    }
+    if (charz_step == CHARZ_MODEM_TX && Particle.connected()) {
+        char stats[32];
+        snprintf(stats, sizeof(stats), "%.2f(%%),%.3f(V)", soc, vcell);
+        Particle.publish("CHARZ_SAMPLE", stats);
+    }
+    charz_step_min_soc = min(charz_step_min_soc, soc);
+
+    // Stop conditions, most serious first
+    if (soc <= 0 || soc > 110.0 || vcell <= 0) {
+        charz_stop(charz_step_min_soc, "gauge");
+    }
+    else if (vcell < CHARZ_CUTOFF_VCELL) {
+        charz_stop(soc, "vcell");
+    }
+    else if (soc < CHARZ_CUTOFF_CAPACITY) {
+        charz_stop(soc, "cutoff");
+    }
+    else if (soc > charz_step_min_soc + CHARZ_CHARGING_RISE) {
+        charz_stop(charz_step_min_soc, "charging");
+    }
+    else if (now - charz_start_ms > CHARZ_MAX_MS) {
+        charz_stop(soc, "timeout");
+    }
+    else if (charz_stop_request) {
+        charz_stop_request = false;
+        charz_stop(soc, "abort");
+    }
+    else if (now - charz_step_start_ms >= CHARZ_STEP_MS) {
+        charz_finish_step(soc);
+        charz_enter_step((charz_step + 1) % CHARZ_NUM_STEPS, soc);
+    }
 }
 
-void reset_battery_capacity() {
-    FuelGauge().quickStart();
-    // must delay at least 175ms after quickstart, before calling
-    // getSoC(), or reading will not have updated yet.
-    delay(200);
+/*
+ * Command registry - every command is one entry in commands[] below, shared by the Serial1
+ * console and the "cmd" cloud function, so adding a command never costs a function slot.
+ *
+ * A command line is a single key character optionally followed by an argument, e.g. "Q",
+ * "l 10" or "p 25".  On Serial1, keys without an argument run as soon as they are pressed
+ * (like they always have), and the others run on Enter.
+ *
+ * From the cloud, cmd returns the command's return value directly, so a query is a single
+ * round trip.  Any text output is published as a "CMD" event.  Commands flagged async
+ * (anything that blocks, sleeps, touches the modem, or walks or writes state loop() owns
+ * without a lock, like the history ring or retained settings) can't run in the system thread, so
+ * they are queued for loop(), the call returns a ticket number right away, and completion
+ * is published as "CMD" with "<ticket>,<return value>,<output>".
+ */
+enum cmd_arg_type_t {
+    ARG_NONE,
+    ARG_INT,    // optional integer
+    ARG_STR,    // optional string
+};
+
+struct cmd_args_t {
+    bool present;
+    int32_t num;
+    const char* str;
+};
+
+typedef int (*cmd_handler_t)(const cmd_args_t& args, Print& out);
+
+struct command_t {
+    char key;
+    uint8_t arg_type;
+    bool async;
+    cmd_handler_t handler;
+    const char* help;
+};
+
+const int CMD_ERR_UNKNOWN = -100;
+const int CMD_ERR_ARG = -101;
+const int CMD_ERR_BUSY = -102;
+
+int cmd_quickstart(const cmd_args_t& args, Print& out) {
+    reset_battery_capacity();
+    battery_state_poll(true);
+    battery_state_t state = battery_state();
+    out.printlnf("Quickstart and Battery stats: %.2f(%%),%.3f(V)", state.soc, state.vcell);
+    return (int)state.soc;
 }
 
-void publish_pmic_stats_event(String eventname) {
-    String stats = String(FuelGauge().getSoC()) + "(\%)," + String(FuelGauge().getVCell()) + "(V)";
-    Particle.publish(eventname, stats);
-    #ifdef SERIAL_DEBUGGING
-        stats = eventname + " " + stats;
-        MY_SERIAL.println(stats.c_str());
-        delay(100);
-    #endif
+int cmd_stats(const cmd_args_t& args, Print& out) {
+    battery_state_t state = battery_state();
+    out.printlnf("Battery stats: %.2f(%%),%.3f(V) %lums ago", state.soc, state.vcell, millis() - state.updated);
+    return (int)state.soc;
 }
 
-void publish_pmic_stats(void) {
-    publish_pmic_stats_event(String("UPDATE"));
+int cmd_hibernate(const cmd_args_t& args, Print& out) {
+    if (!request_hibernate_check()) {
+        out.println("qualify_battery_and_hibernate() already pending");
+        return 1;
+    }
+    out.println("Running qualify_battery_and_hibernate()");
+    return 0;
 }
 
-int get_soc(String c) {
-    return (int)(FuelGauge().getSoC());
+int cmd_version(const cmd_args_t& args, Print& out) {
+    out.printlnf("Fuel Gauge hardware version: %d", gauge_version);
+    return gauge_version;
 }
 
-int get_battv(String c) {
-    return (int)(100 * FuelGauge().getVCell());
+int cmd_sample(const cmd_args_t& args, Print& out) {
+    publish_pmic_stats();
+    return 0;
+}
+
+int cmd_charz_start(const cmd_args_t& args, Print& out) {
+    if (charz_active) return 1;
+    if (battery_state().soc < CHARZ_START_CAPACITY) {
+        out.printlnf("Characterization needs at least %.1f(%%)", CHARZ_START_CAPACITY);
+        return -1;
+    }
+    charz_start_request = true;
+    return 0;
+}
+
+int cmd_charz_stop(const cmd_args_t& args, Print& out) {
+    if (!charz_active) return 1;
+    charz_stop_request = true;
+    return 0;
+}
+
+int cmd_history(const cmd_args_t& args, Print& out) {
+    history_dump(out, (args.present && args.num >= 0) ? args.num : HISTORY_WORDS);
+    return history.samples;
 }
 
 /*
- * Make sure we are at minimum hibernating the system for long enough to charge up past 30%
- * battery capacity.  If we normally charge at a 512mA average with the supplied 2000mAh battery,
- * a 512mA charging rate would ideally charge the battery within 2*60 minutes for 100% of the
- * battery(it's more like 2.5 hours due to the top off phase, but we can just consider the bulk
- * constant current charge rate), or 120/10 for 10% of the battery.  Be safe and go with double
- * that, or 24 minutes.
+ * [p] <threshold %>[,<backoff base seconds>[,<max exponent>[,<version>[,<standby %>]]]]
+ * Fields left out keep their current value.
  */
-void qualify_battery_and_hibernate() {
-    if (battery_lower_than(LOW_BATT_CAPACITY)) {
-        uint32_t sleep_time = 144 * sleep_backoff(++low_batt_sleep_attempts) / 100;
-        if (Particle.connected()) {
-            publish_pmic_stats_event("SLEEP " + String(sleep_time));
-            delay(5000); // should not need this after 0.6.1 is released
+int cmd_policy(const cmd_args_t& args, Print& out) {
+    if (args.present) {
+        sleep_policy_t p = sleep_policy();
+        uint8_t parsed = 0;
+        long values[5] = { (long)p.low_batt_capacity, (long)p.backoff_base, p.backoff_max_exponent, p.version, p.standby_soc };
+        const char* text = args.str;
+        while (parsed < 5 && *text) {
+            char* end;
+            values[parsed++] = strtol(text, &end, 10);
+            if (end == text || (*end != ',' && *end != '\0')) return CMD_ERR_ARG;
+            text = (*end == ',') ? end + 1 : end;
         }
-        #ifdef SERIAL_DEBUGGING
-            String stats = "SLEEP " + String(sleep_time) + " " + String(FuelGauge().getSoC()) + "(\%)," + String(FuelGauge().getVCell()) + "(V)";
-            MY_SERIAL.println(stats.c_str());
-            delay(100);
-        #endif
-        System.sleep(SLEEP_MODE_SOFTPOWEROFF, sleep_time);
+        if (*text || parsed == 0 || values[1] < 0 || values[2] < 0 || values[3] < 0 || values[4] < 0) return CMD_ERR_ARG;
+        p.low_batt_capacity = values[0];
+        p.backoff_base = values[1];
+        p.backoff_max_exponent = min(values[2], 255L);
+        p.version = min(values[3], 65535L);
+        p.standby_soc = min(values[4], 255L);
+        if (!sleep_policy_valid(p)) {
+            out.printlnf("Threshold must be %.0f-%.0f(%%), base %lu-%lus, max exponent 0-%u, standby 0 or %.0f-threshold(%%)",
+                    LOW_BATT_CAPACITY, MAX_LOW_BATT_CAPACITY, MIN_BACKOFF_BASE, MAX_BACKOFF_BASE, MAX_BACKOFF_MAX_EXPONENT,
+                    STANDBY_FLOOR_SOC);
+            return CMD_ERR_ARG;
+        }
+        policy = p;
     }
-    low_batt_sleep_attempts = 0; // reset if we don't hibernate
+    const sleep_policy_t& p = sleep_policy();
+    out.printlnf("Policy v%u: hibernate below %.1f(%%) for %lus, doubling up to 2^%u, standby from %u(%%)",
+            p.version, p.low_batt_capacity, p.backoff_base, p.backoff_max_exponent, p.standby_soc);
+    return p.version;
+}
+
+int cmd_plan(const cmd_args_t& args, Print& out) {
+    if (args.present) {
+        sleep_plan_t p;
+        memset(&p, 0, sizeof(p));
+        uint32_t values[3 + PLAN_MAX_WAKES];
+        uint8_t parsed = 0;
+        const char* text = args.str;
+        while (parsed < 3 + PLAN_MAX_WAKES && *text) {
+            char* end;
+            values[parsed++] = strtoul(text, &end, 10);
+            if (end == text || (*end != ',' && *end != '\0')) return CMD_ERR_ARG;
+            text = (*end == ',') ? end + 1 : end;
+        }
+        if (*text || parsed == 0) return CMD_ERR_ARG;
+        if (parsed == 1 && values[0] == 0) {
+            plan.magic = 0;
+            out.println("Sleep plan cancelled");
+            return 0;
+        }
+        if (parsed < 4 || !Time.isValid()) return CMD_ERR_ARG;
+
+        uint32_t now = Time.now();
+        p.magic = PLAN_MAGIC;
+        p.expiry = now + values[0] * 60;
+        p.min_soc = values[1];
+        p.publish_cadence = values[2];
+        p.num_wakes = parsed - 3;
+        bool valid = values[0] > 0 && values[0] <= PLAN_MAX_LIFETIME / 60
+                && p.min_soc >= LOW_BATT_CAPACITY && p.min_soc <= 100
+                && p.publish_cadence >= PLAN_MIN_CADENCE && p.publish_cadence <= PLAN_MAX_CADENCE;
+        for (uint8_t i = 0; i < p.num_wakes; i++) {
+            if (values[3 + i] > PLAN_MAX_LIFETIME / 60) valid = false;
+            p.wake_times[i] = now + values[3 + i] * 60;
+            if (i > 0 && p.wake_times[i] <= p.wake_times[i - 1]) valid = false;
+        }
+        if (!valid) {
+            out.println("Bad sleep plan, see the comment above sleep_plan_t");
+            return CMD_ERR_ARG;
+        }
+        p.checksum = sleep_plan_checksum(p);
+        plan = p;
+    }
+    const sleep_plan_t* p = sleep_plan();
+    if (p == NULL) {
+        out.println("No sleep plan, following the local policy");
+        return 0;
+    }
+    out.printlnf("Sleep plan for %lumin: hibernate below %.1f(%%), publish every %lus, next wake in %lus",
+            (p->expiry - Time.now()) / 60, p->min_soc, p->publish_cadence, sleep_plan_next_wake());
+    return p->num_wakes;
+}
+
+int cmd_ack(const cmd_args_t& args, Print& out) {
+    if (!args.present) {
+        out.printlnf("Samples %lu, acked %lu", history.newest_seq, history.acked_seq);
+        return history.newest_seq - history.acked_seq;
+    }
+    if (args.num < 0) return CMD_ERR_ARG;
+    int behind = CMD_ERR_ARG;
+    // loop() appends to the history with thread switching off, so the ack does too
+    SINGLE_THREADED_BLOCK() {
+        if ((uint32_t)args.num <= history.newest_seq) {
+            if ((uint32_t)args.num > history.acked_seq) history.acked_seq = args.num;
+            // the newest UPDATE may still be on its way (or held for the modem), that's not a gap
+            uint32_t in_flight = 1 + (pending_update.pending ? 1 : 0);
+            resend_pending = history.newest_seq - history.acked_seq > in_flight;
+            behind = history.newest_seq - history.acked_seq;
+        }
+    }
+    return behind;
 }
 
 /*
- * Make sure we are polling the battery capacity with enough frequency to ensure it doesn't get to 10%.
- * If our threshold is 20%, then we need to be polling at least as frequently as it takes to go from
- * 20% to 10% during the worst case load.  Let's assume 250mA average with the supplied 2000mAh battery.
- * A 0.2C discharge rate (400mA) should last 5*60 minutes per battery spec, so 250mA should last 8*60 minutes
- * for 100% of the battery, or 480/10 for 10% of the battery.  Be safe and go with half, or 24 minutes.
+ * [t] <minutes>[,<sample seconds>] start a capture, [t] 0 stop it and upload what's there.
+ */
+int cmd_capture(const cmd_args_t& args, Print& out) {
+    if (args.present) {
+        char* end;
+        long minutes = strtol(args.str, &end, 10);
+        long period = 5;
+        if (*end == ',') period = strtol(end + 1, &end, 10);
+        if (*end || minutes < 0 || (uint32_t)minutes > CAPTURE_MAX_MINUTES || period < 1 || period > 600) {
+            return CMD_ERR_ARG;
+        }
+        if (minutes == 0) {
+            if (capture.recording) capture_stop();
+        }
+        else {
+            capture_start(minutes, period);
+        }
+    }
+    out.printlnf("Capture %u: %s, %u words, %u chunks", capture.session,
+            capture.recording ? "recording" : (capture_uploading ? "uploading" : "idle"),
+            capture.len, capture_chunks());
+    return capture.session;
+}
+
+int cmd_capture_resend(const cmd_args_t& args, Print& out) {
+    if (capture.recording || !args.present || args.num < 0 || args.num >= capture_chunks()) return CMD_ERR_ARG;
+    capture_resend_chunk = args.num;
+    return args.num;
+}
+
+int cmd_sketch(const cmd_args_t& args, Print& out) {
+    if (sketch.magic != SKETCH_MAGIC) sketch_clear();
+    const float qs[] = { 0.01, 0.05, 0.5, 0.95 };
+    out.printlnf("Sketch since %lu, %lu samples", sketch.start, sketch.soc.n);
+    out.printf("  SoC  mean %.1f sd %.1f min %.1f", sketch.soc.mean, sketch_stats_sd(sketch.soc), sketch.soc.min);
+    for (uint8_t i = 0; i < 4; i++) {
+        out.printf(" p%.0f %.1f", qs[i] * 100, sketch_quantile(sketch.soc_bins, SKETCH_SOC_BINS, 0, 100 / SKETCH_SOC_BINS, qs[i]));
+    }
+    out.println();
+    out.printf("  mV   mean %.0f sd %.0f min %.0f", sketch.mv.mean, sketch_stats_sd(sketch.mv), sketch.mv.min);
+    for (uint8_t i = 0; i < 4; i++) {
+        out.printf(" p%.0f %.0f", qs[i] * 100, sketch_quantile(sketch.mv_bins, SKETCH_MV_BINS, SKETCH_MV_MIN, SKETCH_MV_STEP, qs[i]));
+    }
+    out.println();
+    return sketch.soc.n;
+}
+
+/*
+ * [B] show the sleep bandit, [B] 0|1 turn it off or on, [B] r forget what it learned.
+ */
+int cmd_bandit(const cmd_args_t& args, Print& out) {
+    bandit_init();
+    if (args.present) {
+        if (args.str[0] == 'r') {
+            bandit.magic = 0;
+            bandit_init();
+        }
+        else if (args.str[0] == '0' || args.str[0] == '1') bandit.enabled = (args.str[0] == '1');
+        else return CMD_ERR_ARG;
+    }
+    const sleep_policy_t& p = sleep_policy();
+    out.printlnf("Sleep bandit %s: %lu wakes, %lu wasted", bandit.enabled ? "on" : "off", bandit.wakes, bandit.wasted);
+    for (uint8_t k = 0; k <= p.backoff_max_exponent && k < BANDIT_ARMS; k++) {
+        const bandit_arm_t& arm = bandit.arms[k];
+        out.printlnf("  %6lus resumed %u wasted %u (%.0f%%)%s", p.backoff_base << k, arm.resumed, arm.wasted,
+                100.0 * (1 + arm.resumed) / (2 + arm.resumed + arm.wasted), (k == bandit.pending) ? " <" : "");
+    }
+    return bandit.wakes;
+}
+
+int cmd_usage(const cmd_args_t& args, Print& out) {
+    char diag[128];
+    format_usage(diag, sizeof(diag));
+    out.printlnf("Battery usage: %s", diag);
+    return (int)usage.cycles;
+}
+
+int cmd_schedule(const cmd_args_t& args, Print& out) {
+    uint32_t now = schedule_clock();
+    uint32_t drift = 0;
+    out.printlnf("Schedule on %s clock", schedule_on_rtc ? "RTC" : "uptime");
+    for (uint8_t i = 0; i < NUM_TASKS; i++) {
+        const scheduled_task_t& task = tasks[i];
+        out.printlnf("%-12s every %lus, next in %lds, %lu runs, %lu skipped, drift %lus (max %lus)%s",
+                task.name, task.period, (long)(task.deadline - now), task.runs, task.skipped,
+                task.drift_total, task.drift_max, task.enabled ? "" : ", paused");
+        drift += task.drift_total;
+    }
+    return drift;
+}
+
+int cmd_power(const cmd_args_t& args, Print& out) {
+    uint32_t up = millis();
+    for (uint8_t i = 0; i < NUM_POWER_RESOURCES; i++) {
+        if (i == POWER_I2C) continue;   // never gated, see the power manager
+        const power_resource_t& res = power_resources[i];
+        uint32_t on = power_on_time(i);
+        out.printlnf("%-8s %-4s refs %u, on %lus of %lus (%lu%%)", res.name, res.powered ? "on" : (res.held_off ? "held" : "off"),
+                res.refs, on / 1000, up / 1000, (uint32_t)(100ULL * on / max(up, (uint32_t)1)));
+    }
+    out.printlnf("app idle %lus of %lus (%lu%%), %lu bursts", governor_idle_ms / 1000, up / 1000,
+            (uint32_t)(100ULL * governor_idle_ms / max(up, (uint32_t)1)), governor_bursts);
+    return power_on_time(POWER_MODEM) / 1000;
+}
+
+int cmd_crash(const cmd_args_t& args, Print& out) {
+    if (crash.reason == 0) {
+        out.println("No crash recorded");
+        return 0;
+    }
+    const trace_log_t& t = crash.trace;
+    out.printlnf("Crash rr %ld code %lu at %lu, task %s, up %lus, heap %lu, %lu in a row%s",
+            crash.reason, crash.data, crash.time, crash_task_name(t.active_task), t.up, t.heap_free,
+            crash.count, crash.published ? "" : ", not published yet");
+    uint8_t count = min(t.count, TRACE_EVENTS);
+    for (uint8_t i = 0; i < count; i++) {
+        uint32_t word = t.events[(t.head + TRACE_EVENTS - count + i) % TRACE_EVENTS];
+        out.printlnf("  %5lus event %lu arg %lu", word & 0xFFFF, word >> 24, (word >> 16) & 0xFF);
+    }
+    return crash.count;
+}
+
+int cmd_memory(const cmd_args_t& args, Print& out) {
+    uint32_t free_now = System.freeMemory();
+    out.printlnf("Heap free: %lu now, %lu at lock, %lu min, %lu allocations after setup()",
+            free_now, heap_free_at_lock, heap_free_min, heap_locked_allocs);
+    return heap_locked_allocs;
+}
+
+/*
+ * [d] one frame with everything a health check needs, instead of a round trip per value.  Built
+ * from cached state only (the battery snapshot, counters), so it never waits on I2C or the modem.
+ * Sent as "D<format> <base64>" of this struct, little endian, so the backend decodes it with
+ * one unpack, e.g. Python's struct.unpack("<BBHHHhhHBBBBHIIHHIIIIII", ...).
+ */
+const uint8_t DIAG_BUNDLE_FORMAT = 1;
+
+enum diag_flag_t {
+    DIAG_FLAG_PLAN = 0x01,
+    DIAG_FLAG_CONNECTED = 0x02,
+    DIAG_FLAG_MODEM_ON = 0x04,
+    DIAG_FLAG_SERIAL_ON = 0x08,
+    DIAG_FLAG_CHARZ = 0x10,
+    DIAG_FLAG_CAPTURE = 0x20,
+    DIAG_FLAG_STANDBY_HOLD = 0x40,
+    DIAG_FLAG_CRASH_PENDING = 0x80,
+};
+
+struct diag_bundle_t {
+    uint8_t format;
+    uint8_t wake_reason;
+    uint16_t gauge_version;
+    uint16_t soc;               // 0.01%
+    uint16_t vcell;             // mV
+    int16_t discharge_rate;     // 0.01%/h
+    int16_t charge_rate;        // 0.01%/h
+    uint16_t policy_version;
+    uint8_t threshold;          // % hibernate threshold in effect
+    uint8_t sleep_attempts;     // hibernates in a row, the backoff step
+    uint8_t flags;              // diag_flag_t
+    uint8_t crash_count;
+    uint16_t heap_allocs;       // since heap_lock(), saturating
+    uint32_t uptime;            // s
+    uint32_t heap_free_min;
+    uint16_t stack_used;        // bytes, see stack_mark()
+    uint16_t connects;
+    uint32_t connect_ms;        // the last connect took
+    uint32_t modem_on;          // s
+    uint32_t cycles;            // 0.01 equivalent full cycles
+    uint32_t secs_below_low;
+    uint32_t newest_seq;
+    uint32_t system_version;
+};
+static_assert(sizeof(diag_bundle_t) == 56, "diag bundle must not have padding");
+
+/*
+ * [M] <commissioning|production|storm|auto>, or the first letter.
  */
-Timer batt_monitor(24*60*1000, qualify_battery_and_hibernate);
+int cmd_profile(const cmd_args_t& args, Print& out) {
+    if (args.present) {
+        uint8_t setting = PROFILE_NO_REQUEST;
+        if (args.str[0] == 'a') setting = PROFILE_AUTO | PROFILE_PRODUCTION;
+        for (uint8_t i = 0; i < NUM_PROFILES; i++) {
+            if (args.str[0] == profiles[i].name[0]) setting = i;
+        }
+        if (setting == PROFILE_NO_REQUEST) return CMD_ERR_ARG;
+        profile_request(setting);
+        out.printlnf("Profile: switching to %s", (setting & PROFILE_AUTO) ? "auto" : profiles[setting].name);
+        return setting;
+    }
+    const power_profile_t& p = profile();
+    out.printlnf("Profile: %s%s, publish %lus, poll %lums, threshold floor %.0f(%%)", p.name,
+            (profile_setting & PROFILE_AUTO) ? " (auto)" : "", p.publish_cadence, p.battery_poll_ms, p.threshold_floor);
+    return profile_active;
+}
+
+int cmd_diag_bundle(const cmd_args_t& args, Print& out) {
+    battery_state_t state = battery_state();
+    diag_bundle_t b;
+    b.format = DIAG_BUNDLE_FORMAT;
+    b.wake_reason = wake_reason;
+    b.gauge_version = gauge_version;
+    b.soc = state.soc * 100 + 0.5;
+    b.vcell = state.vcell * 1000 + 0.5;
+    b.discharge_rate = state.discharge_rate * 100;
+    b.charge_rate = state.charge_rate * 100;
+    b.policy_version = sleep_policy().version;
+    b.threshold = low_batt_threshold();
+    b.sleep_attempts = min(low_batt_sleep_attempts, (uint32_t)255);
+    b.flags = (sleep_plan() != NULL ? DIAG_FLAG_PLAN : 0)
+            | (Particle.connected() ? DIAG_FLAG_CONNECTED : 0)
+            | (power_is_on(POWER_MODEM) ? DIAG_FLAG_MODEM_ON : 0)
+            | (power_is_on(POWER_SERIAL) ? DIAG_FLAG_SERIAL_ON : 0)
+            | (charz_active ? DIAG_FLAG_CHARZ : 0)
+            | (capture.recording ? DIAG_FLAG_CAPTURE : 0)
+            | (standby_hold ? DIAG_FLAG_STANDBY_HOLD : 0)
+            | (crash.published ? 0 : DIAG_FLAG_CRASH_PENDING);
+    b.crash_count = min(crash.count, (uint32_t)255);
+    b.heap_allocs = min((uint32_t)heap_locked_allocs, (uint32_t)65535);
+    b.uptime = millis() / 1000;
+    b.heap_free_min = heap_free_min;
+    b.stack_used = stack_used_max;
+    b.connects = modem_connects;
+    b.connect_ms = modem_connect_ms;
+    b.modem_on = power_on_time(POWER_MODEM) / 1000;
+    b.cycles = usage.cycles * 100;
+    b.secs_below_low = usage.secs_below_low;
+    b.newest_seq = history.newest_seq;
+    b.system_version = System.versionNumber();
+
+    char text[4 * sizeof(b) / 3 + 8];
+    base64_encode((const uint8_t*)&b, sizeof(b), text, sizeof(text));
+    out.printlnf("D%u %s", DIAG_BUNDLE_FORMAT, text);
+    return sizeof(b);
+}
+
+int cmd_help(const cmd_args_t& args, Print& out);
+
+constexpr command_t commands[] = {
+    { 'q', ARG_NONE, true,  cmd_quickstart,   "run Fuel Gauge [q]uickStart and read SoC and BattV" },
+    { 'Q', ARG_NONE, false, cmd_stats,        "read SoC and BattV" },
+    { 'b', ARG_NONE, false, cmd_hibernate,    "run qualify_[b]attery_and_hibernate" },
+    { 'v', ARG_NONE, false, cmd_version,      "get Fuel Gauge hardware [v]ersion" },
+    { 's', ARG_NONE, true,  cmd_sample,       "force a [s]ample and publish it now" },
+    { 'c', ARG_NONE, false, cmd_charz_start,  "start battery [c]haracterization" },
+    { 'C', ARG_NONE, false, cmd_charz_stop,   "stop battery [C]haracterization" },
+    { 'l', ARG_INT,  true,  cmd_history,      "[l] <n> dump the newest n history samples as CSV" },
+    { 'p', ARG_STR,  true,  cmd_policy,       "[p] <%>,<base s>,<max exp>,<ver>,<standby %> show or set the hibernate [p]olicy" },
+    { 'P', ARG_STR,  true,  cmd_plan,         "[P] <expires>,<%>,<publish s>,<wake>... (minutes) show, set or cancel (0) the sleep [P]lan" },
+    { 'a', ARG_INT,  false, cmd_ack,          "[a] <seq> [a]cknowledge samples up to seq, resend the ones after it" },
+    { 't', ARG_STR,  true,  cmd_capture,      "[t] <minutes>,<sample s> start (0 stop) a [t]race capture, uploaded as TRACE events" },
+    { 'T', ARG_INT,  true,  cmd_capture_resend, "[T] <chunk> upload a [T]RACE chunk again" },
+    { 'B', ARG_STR,  true,  cmd_bandit,       "[B] <0|1|r> show, turn off/on or reset the sleep [B]andit" },
+    { 'k', ARG_NONE, true,  cmd_sketch,       "show today's SoC/VCell s[k]etch: mean, sd, min and quantiles" },
+    { 'u', ARG_NONE, true,  cmd_usage,        "show battery [u]sage: cycles, seconds below threshold, DoD histogram" },
+    { 'S', ARG_NONE, false, cmd_schedule,     "show the [S]chedule: deadlines, skipped slots and drift" },
+    { 'o', ARG_NONE, false, cmd_power,        "show peripheral power state and time [o]n" },
+    { 'x', ARG_NONE, false, cmd_crash,        "show the last crash record and its trace (e[x]ception)" },
+    { 'M', ARG_STR,  false, cmd_profile,      "[M] <commissioning|production|storm|auto> show or switch the power profile ([M]ode)" },
+    { 'd', ARG_NONE, true,  cmd_diag_bundle,  "one frame [d]iagnostics bundle (base64), for the backend" },
+    { 'm', ARG_NONE, false, cmd_memory,       "show heap [m]emory and allocations since setup()" },
+    { 'h', ARG_NONE, false, cmd_help,         "show this [h]elp menu" },
+};
+constexpr size_t NUM_COMMANDS = sizeof(commands) / sizeof(commands[0]);
 
 /*
- * Publish data every minute to give the Electron a test workout
+ * Keys are 7-bit ASCII, so the key itself is a collision free (perfect) hash into
+ * cmd_slot[], as long as no two commands share a key.  Check that when compiling.
  */
-Timer publish_data(1*60*1000, publish_pmic_stats);
+constexpr bool cmd_keys_unique(size_t i = 0, size_t j = 1) {
+    return (i >= NUM_COMMANDS) ? true
+         : (j >= NUM_COMMANDS) ? cmd_keys_unique(i + 1, i + 2)
+         : (commands[i].key != commands[j].key && (commands[i].key & 0x80) == 0 && cmd_keys_unique(i, j + 1));
+}
+static_assert(cmd_keys_unique(), "command keys must be unique 7-bit characters");
+
+int8_t cmd_slot[128];
+
+void cmd_init() {
+    memset(cmd_slot, -1, sizeof(cmd_slot));
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        cmd_slot[(uint8_t)commands[i].key] = i;
+    }
+}
+
+const command_t* cmd_find(char key) {
+    if (key & 0x80) return NULL;
+    int8_t slot = cmd_slot[(uint8_t)key];
+    return (slot < 0) ? NULL : &commands[slot];
+}
+
+int cmd_help(const cmd_args_t& args, Print& out) {
+    out.println("\r\nPress a key to run a command, commands with an argument end with Enter:");
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        if (commands[i].arg_type == ARG_NONE) out.printf("[%c] ", commands[i].key);
+        out.println(commands[i].help);
+    }
+    return 0;
+}
 
 void showHelp() {
-    Serial1.println("\r\nPress a key to run a command:"
-                   "\r\n[q] run Fuel Gauge [q]uickStart and read SoC and BattV"
-                   "\r\n[b] run qualify_[b]attery_and_hibernate"
-                   "\r\n[v] get Fuel Gauge hardware [v]ersion"
-                   "\r\n[h] show this [h]elp menu\r\n");
+    cmd_args_t args = { false, 0, "" };
+    cmd_help(args, MY_SERIAL);
+}
+
+/*
+ * @param cmd The command the argument is for.
+ * @param text Everything after the key.
+ * @param args Filled in with the typed argument.
+ * @return `false` if the argument doesn't match the command's argument type.
+ */
+bool cmd_parse_args(const command_t& cmd, const char* text, cmd_args_t& args) {
+    while (*text == ' ') text++;
+    args.present = (*text != '\0');
+    args.num = 0;
+    args.str = text;
+    if (!args.present) return true;
+    if (cmd.arg_type == ARG_NONE) return false;
+    if (cmd.arg_type == ARG_INT) {
+        char* end;
+        args.num = strtol(text, &end, 10);
+        while (*end == ' ') end++;
+        return end != text && *end == '\0';
+    }
+    return true;
+}
+
+/*
+ * Runs one command line.
+ * @return The command's return value, or one of the CMD_ERR_ codes.
+ */
+int cmd_execute(const char* line, Print& out) {
+    const command_t* cmd = cmd_find(line[0]);
+    if (cmd == NULL) {
+        out.println("Bad command! Press [h] for help menu.");
+        return CMD_ERR_UNKNOWN;
+    }
+    trace(TRACE_CMD, cmd->key);
+    cmd_args_t args;
+    if (!cmd_parse_args(*cmd, line + 1, args)) {
+        out.printlnf("Bad argument for [%c]! Press [h] for help menu.", cmd->key);
+        return CMD_ERR_ARG;
+    }
+    return cmd->handler(args, out);
+}
+
+/*
+ * Collects command output in a fixed buffer so it can be published as a single event.
+ */
+class CmdOutput : public Print {
+public:
+    static const size_t CAPACITY = 200;
+    char text[CAPACITY + 1];
+    size_t len;
+
+    CmdOutput() : len(0) { text[0] = '\0'; }
+
+    virtual size_t write(uint8_t c) {
+        if (len >= CAPACITY) return 0;
+        if (c == '\r') return 1;   // keep events compact, \n is enough
+        text[len++] = c;
+        text[len] = '\0';
+        return 1;
+    }
+    using Print::write;
+};
+
+/*
+ * Cloud commands waiting for loop(), either to run (async) or to publish their output.
+ * Single producer (system thread) and single consumer (loop()).  Each side publishes its index
+ * with a release store after it is done with the slot, so the other side never sees the index
+ * move before the slot's contents (volatile alone doesn't order the plain stores around it).
+ */
+struct cmd_request_t {
+    uint16_t ticket;
+    bool done;
+    int rc;
+    char line[64];
+    CmdOutput output;
+};
+const uint8_t CMD_QUEUE_SIZE = 4;
+cmd_request_t cmd_queue[CMD_QUEUE_SIZE];
+std::atomic<uint8_t> cmd_queue_head(0);    // written by the system thread
+std::atomic<uint8_t> cmd_queue_tail(0);    // written by loop()
+uint16_t cmd_next_ticket = 1;
+
+/*
+ * The "cmd" cloud function.
+ * @return The command's return value, the ticket of a queued async command, or a CMD_ERR_ code.
+ */
+int cloud_cmd(String c) {
+    cloud_activity = true; // someone is using the modem, don't gate it
+    const char* line = c.c_str();
+    const command_t* cmd = cmd_find(line[0]);
+    if (cmd == NULL) return CMD_ERR_UNKNOWN;
+    if (c.length() >= sizeof(cmd_queue[0].line)) return CMD_ERR_ARG;
+
+    uint8_t head = cmd_queue_head.load(std::memory_order_relaxed);
+    uint8_t next = (head + 1) % CMD_QUEUE_SIZE;
+    if (next == cmd_queue_tail.load(std::memory_order_acquire)) return CMD_ERR_BUSY;
+
+    cmd_request_t& request = cmd_queue[head];
+    request.output = CmdOutput();
+    strcpy(request.line, line);
+    if (cmd->async) {
+        request.ticket = cmd_next_ticket++;
+        if (cmd_next_ticket > 30000) cmd_next_ticket = 1;
+        request.done = false;
+        request.rc = 0;
+    }
+    else {
+        request.ticket = 0;
+        request.done = true;
+        request.rc = cmd_execute(line, request.output);
+        if (request.output.len == 0) return request.rc;   // nothing to publish
+    }
+    cmd_queue_head.store(next, std::memory_order_release);
+    return cmd->async ? request.ticket : request.rc;
+}
+
+/*
+ * Runs queued async cloud commands and publishes pending command output, one per loop().
+ */
+void cmd_process() {
+    uint8_t tail = cmd_queue_tail.load(std::memory_order_relaxed);
+    if (tail == cmd_queue_head.load(std::memory_order_acquire)) return;
+    cmd_request_t& request = cmd_queue[tail];
+    if (!request.done) {
+        request.rc = cmd_execute(request.line, request.output);
+        request.done = true;
+    }
+    power_touch(POWER_MODEM);
+    if (Particle.connected()) {
+        char event[sizeof(request.output.text) + 16];
+        snprintf(event, sizeof(event), "%u,%d,%s", request.ticket, request.rc, request.output.text);
+        trace(TRACE_PUBLISH, 'C');
+        Particle.publish("CMD", event);
+    }
+    cmd_queue_tail.store((tail + 1) % CMD_QUEUE_SIZE, std::memory_order_release);
 }
 
 void toggleD7() {
+    if (!power_is_on(POWER_SERIAL) || !profile().heartbeat) return; // nobody on the bench to see it
     if (millis()-lastBlink > 100) {
+        power_touch(POWER_LED);
         lastBlink = millis();
         digitalWrite(D7, !digitalRead(D7));
     }
 }
 
+char serial_line[64];
+uint8_t serial_line_len = 0;
+
 void processSerial() {
-    if (MY_SERIAL.available() > 0)
+    while (MY_SERIAL.available() > 0)
     {
         char c = MY_SERIAL.read();
-        if (c == 'q') {
-            reset_battery_capacity();
-            String stats = String(FuelGauge().getSoC()) + "(\%)," + String(FuelGauge().getVCell()) + "(V)";
-            MY_SERIAL.printlnf("Quickstart and Battery stats: %s", stats.c_str());
-        }
-        else if (c == 'Q') {
-            String stats = String(FuelGauge().getSoC()) + "(\%)," + String(FuelGauge().getVCell()) + "(V)";
-            MY_SERIAL.printlnf("Battery stats: %s", stats.c_str());
-        }
-        else if (c == 'b') {
-            MY_SERIAL.println("Running qualify_battery_and_hibernate()");
-            qualify_battery_and_hibernate();
-        }
-        else if (c == 'v') {
-            MY_SERIAL.printlnf("Fuel Gauge hardware version: %d", FuelGauge().getVersion());
+        if (c == '\r' || c == '\n') {
+            if (serial_line_len > 0) {
+                serial_line[serial_line_len] = '\0';
+                serial_line_len = 0;
+                cmd_execute(serial_line, MY_SERIAL);
+            }
         }
-        else if (c == 'h') {
-            showHelp();
+        else if (serial_line_len == 0) {
+            const command_t* cmd = cmd_find(c);
+            if (cmd == NULL || cmd->arg_type == ARG_NONE) {
+                char line[2] = { c, '\0' };
+                cmd_execute(line, MY_SERIAL);
+                while (MY_SERIAL.available()) MY_SERIAL.read(); // Flush the input buffer
+            }
+            else {
+                serial_line[serial_line_len++] = c;
+            }
         }
-        else {
-            MY_SERIAL.println("Bad command! Press [h] for help menu.");
+        else if (serial_line_len < sizeof(serial_line) - 1) {
+            serial_line[serial_line_len++] = c;
         }
-        while (MY_SERIAL.available()) MY_SERIAL.read(); // Flush the input buffer
     }
     //if (Particle.connected()) Particle.process(); // Required for MANUAL mode
 }
 
+/*
+ * Idle governor - without it loop() spins flat out between one-minute deadlines.  Device OS owns
+ * the system clock (USART baud and timer prescalers are derived from it), so instead of scaling
+ * the clock the app thread is parked in delay() whenever nothing is pending, which leaves the
+ * CPU to the RTOS idle task.  Anything in flight (commands, resends, a held UPDATE, a hibernate
+ * check, characterization, serial input) runs as a burst with no idling at all.  The idle stretch
+ * ends at the next battery poll and is capped so serial input can't overrun the RX buffer and
+ * second-resolution schedule deadlines stay on time.
+ */
+const uint32_t GOVERNOR_MAX_IDLE_MS = 250;
+const uint32_t GOVERNOR_SERIAL_IDLE_MS = 20;    // 64 byte RX buffer fills in ~66ms at 9600 baud
+bool governor_busy() {
+    return charz_active || resend_pending || pending_update.pending
+            || cmd_queue_tail != cmd_queue_head || capture_uploading
+            || hibernate_state != HIBERNATE_IDLE
+            || MY_SERIAL.available() > 0;
+}
+
+void governor_idle() {
+    if (governor_busy()) {
+        governor_bursts++;
+        return;
+    }
+    uint32_t idle = power_is_on(POWER_SERIAL) ? GOVERNOR_SERIAL_IDLE_MS : GOVERNOR_MAX_IDLE_MS;
+    uint32_t since_poll = millis() - battery_last_poll;
+    if (since_poll >= profile().battery_poll_ms) return;
+    idle = min(idle, profile().battery_poll_ms - since_poll);
+    uint32_t start = millis();
+    delay(idle);
+    governor_idle_ms += millis() - start;
+}
+
 void setup()
 {
+    uint8_t top;
+    stack_top = (uintptr_t)&top;
     pinMode(D7, OUTPUT);
     MY_SERIAL.begin(9600);
+    power_init();   // before anything prints, the console drops output while it's off
+    crash_capture();
+    cmd_init();
+    history_init();
     Particle.function("soc", get_soc);
     /* Currently FuelGauge().getVCell() will report about 0.1V lower than actual
      * due to software bug that will be fixed in 0.6.1.  This does not affect getSoC().
      * See https://github.com/spark/firmware/pull/1147 */
     Particle.function("battv", get_battv);
+    Particle.function("cmd", cloud_cmd);
+    Particle.variable("eta", eta_text);
 
     /* reset SoC with battery in a resting state,
      * before cellular is enabled which loads the battery down */
     reset_battery_capacity();
-    qualify_battery_and_hibernate();
+    gauge_version = FuelGauge().getVersion();
+    battery_state_poll(true);
+    profile_process();  // the retained profile, before its threshold floor is needed
+    uint32_t wake_attempts = low_batt_sleep_attempts;   // hibernates it took to get here
+    wake_reason = classify_wake();
+    trace(TRACE_WAKE, wake_reason);
+    bandit_wake(wake_reason);
+    crash_loop_backoff();
+    request_hibernate_check();
+    hibernate_process();
+    float rest_vcell = FuelGauge().getVCell();
 
     Particle.connect();
+    modem_connect_started = millis();
     waitFor(Particle.connected, 120000); // this won't be necessary when 0.6.1 is released
-    publish_pmic_stats_event("WAKE");
+    modem_connect_process();    // the boot connect counts too
+    if (Particle.connected()) usage_sag(rest_vcell, FuelGauge().getVCell());
+    char extra[64];
+    snprintf(extra, sizeof(extra), "rr=%d,wk=%s,att=%lu,pol=%u", System.resetReason(),
+            wake_reason_names[wake_reason], wake_attempts, sleep_policy().version);
+    publish_pmic_stats_event("WAKE", extra);
 
-    batt_monitor.start();
-    publish_data.start(); // Optional, this drains the battery for testing and also uses data
+    schedule_start();
 
 #ifdef SERIAL_DEBUGGING
     showHelp();
 #endif
+
+    heap_lock(); // everything from here on should be allocation free
 }
 
 void loop()
@@ -221,5 +3060,48 @@ void loop()
 
     /* Optional, this just help us poke at the battery readings and display them on Serial1 (TX) */
     processSerial();
+
+    heap_watch();
+
+    /* Switch power profile, on request or by SoC band */
+    profile_process();
+
+    /* Gate off peripherals nobody has used for a while */
+    power_process();
+
+    /* The only writer of the shared battery state */
+    battery_state_poll();
+
+    /* The one place a hibernate check runs, whoever asked for it */
+    hibernate_process();
+
+    /* Back from network standby, check the battery again once the ring wake is served */
+    standby_process();
+
+    /* batt_monitor, publish_data and DIAG, on their deadlines */
+    schedule_process();
+
+    /* Async commands from the cloud run here, outside of the system thread */
+    cmd_process();
+
+    /* An UPDATE, DIAG or SKETCH that waited for the modem to connect */
+    pending_update_process();
+    diag_process();
+    sketch_process();
+
+    /* Tell the backend about the last crash */
+    crash_process();
+
+    /* Trace capture: high rate samples while recording, then the upload */
+    capture_process();
+
+    /* Resend samples the backend is missing */
+    resend_process();
+
+    /* Battery characterization runs from loop() and never blocks, so deadlines aren't missed */
+    charz_process();
+
+    /* Nothing pending, give the CPU back until the next deadline */
+    governor_idle();
 }
 
@@ -0,0 +1,98 @@
+/*
+ * Host stand-in for the Device OS API, just enough to compile the firmware with a desktop
+ * compiler (and -fsanitize=thread).  Each test is one translation unit that #includes the
+ * firmware .cpp.  Time, SoC and VCell come from the fake_ globals, publishes and sleeps are
+ * counted, and SINGLE_THREADED_BLOCK() is a global lock instead of a scheduler switch.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#define retained
+#define STARTUP(x)
+#define SYSTEM_THREAD(x)
+#define SYSTEM_MODE(x)
+#define SINGLE_THREADED_BLOCK() for (std::unique_lock<std::recursive_mutex> stb_(host_stb); stb_; stb_.unlock())
+#define waitFor(fn, ms) (fn())
+std::recursive_mutex host_stb;
+
+std::atomic<uint32_t> fake_ms(0), fake_now(1500000000), fake_publishes(0), fake_sleeps(0);
+std::atomic<float> fake_soc(80), fake_vcell(3.9f);
+enum { FEATURE_RETAINED_MEMORY, FEATURE_RESET_INFO, RESET_REASON_NONE, RESET_REASON_POWER_MANAGEMENT,
+       RESET_REASON_PANIC, RESET_REASON_WATCHDOG, SLEEP_MODE_SOFTPOWEROFF, SLEEP_NETWORK_STANDBY,
+       RISING, FALLING, INPUT, INPUT_PULLDOWN, OUTPUT, LOW = 0, HIGH = 1, D7 = 7, WKP = 17, RX = 18, RI_UC = 40 };
+typedef uint8_t byte;
+
+uint32_t millis() { return fake_ms; }
+uint32_t micros() { return fake_ms * 1000; }
+void delay(uint32_t ms) { fake_ms += ms; }
+void pinMode(int, int) {}
+void digitalWrite(int, int) {}
+int digitalRead(int) { return LOW; }
+void attachInterrupt(int, void (*)(), int) {}
+void detachInterrupt(int) {}
+
+struct String {
+    std::string s;
+    String(const char* c = "") : s(c) {}
+    const char* c_str() const { return s.c_str(); }
+    unsigned length() const { return s.size(); }
+};
+struct Print {
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* b, size_t n) { for (size_t i = 0; i < n; i++) write(b[i]); return n; }
+    size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t println(const char* s = "") { return print(s) + print("\r\n"); }
+    size_t vprintf(bool nl, const char* f, va_list a) { char b[256]; vsnprintf(b, sizeof(b), f, a); return nl ? println(b) : print(b); }
+    size_t printf(const char* f, ...) { va_list a; va_start(a, f); size_t n = vprintf(false, f, a); va_end(a); return n; }
+    size_t printlnf(const char* f, ...) { va_list a; va_start(a, f); size_t n = vprintf(true, f, a); va_end(a); return n; }
+};
+struct Stream : Print { virtual int available() = 0; virtual int read() = 0; virtual int peek() = 0; virtual void flush() = 0; };
+struct USARTSerial : Stream {
+    void begin(unsigned long) {}
+    void end() {}
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush() {}
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+} Serial1;
+
+struct FuelGauge {
+    float getSoC() { return fake_soc; }
+    float getVCell() { return fake_vcell; }
+    int getVersion() { return 3; }
+    void quickStart() {}
+};
+struct PMIC { bool isPowerGood() { return false; } };
+struct {
+    template <typename F> bool function(const char*, F) { return true; }
+    template <typename T> bool variable(const char*, T) { return true; }
+    bool publish(const char*, const char* = NULL) { fake_publishes++; return true; }
+    bool connected() { return true; }
+    void connect() {}
+    void disconnect() {}
+    void process() {}
+} Particle;
+struct {
+    void sleep(int, long) { fake_sleeps++; }
+    void sleep(int, int, long, int) { fake_sleeps++; }
+    int resetReason() { return RESET_REASON_NONE; }
+    uint32_t resetReasonData() { return 0; }
+    void enableFeature(int) {}
+    uint32_t freeMemory() { return 64 * 1024; }
+    uint32_t versionNumber() { return 0x00060100; }
+} System;
+struct { uint32_t now() { return fake_now; } bool isValid() { return true; } } Time;
+struct { void on() {} void off() {} } Cellular;
@@ -0,0 +1,62 @@
+/*
+ * Hibernate executor stress test, build with -fsanitize=thread (make tsan).
+ *
+ * loop() runs on its own thread like the app thread, while a timer thread keeps calling
+ * batt_monitor_tick() and a "system thread" keeps sending [b] through the cmd cloud function.
+ * SoC swings across the threshold so some checks hibernate.  ThreadSanitizer reports any
+ * unsynchronized access, and at the end every accepted request must have been run.
+ */
+#include "../firmware/electron-maintain-capacity.cpp"
+
+const int ITERATIONS = 20000;
+
+int main() {
+    setup();
+    std::atomic<bool> stop(false);
+    std::atomic<uint32_t> accepted(0), pending(0), busy(0);
+
+    std::thread app([&] {
+        while (!stop) {
+            loop();
+            fake_ms += 10;
+        }
+    });
+    std::thread timer([&] {
+        for (int i = 0; i < ITERATIONS; i++) {
+            batt_monitor_tick();
+            fake_soc = (i % 64 < 8) ? 10 : 80;
+            std::this_thread::yield();
+        }
+    });
+    std::thread system([&] {
+        for (int i = 0; i < ITERATIONS; i++) {
+            int rc = cloud_cmd("b");
+            if (rc == 0) accepted++;
+            else if (rc == 1) pending++;
+            else if (rc == CMD_ERR_BUSY) busy++;
+            std::this_thread::yield();
+        }
+    });
+    timer.join();
+    system.join();
+
+    fake_soc = 80;
+    for (int i = 0; i < 1000 && hibernate_state != HIBERNATE_IDLE; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop = true;
+    app.join();
+
+    printf("[b] accepted %u, already pending %u, queue busy %u, sleeps %u\n",
+            accepted.load(), pending.load(), busy.load(), fake_sleeps.load());
+    if (hibernate_state != HIBERNATE_IDLE) {
+        printf("FAIL: a hibernate check was left in state %u\n", hibernate_state.load());
+        return 1;
+    }
+    if (accepted == 0 || fake_sleeps == 0) {
+        printf("FAIL: the checks never ran both ways\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Retained history store: the packed record must round trip, and the ring must still decode
+ * after it wrapped and across hibernate gaps.  Then encode/decode throughput, and how much
+ * history 2KB buys packed compared to a struct of floats like last_battery_capacity.
+ */
+#include "../firmware/electron-maintain-capacity.cpp"
+#include <vector>
+
+struct CsvCapture : public Print {
+    std::string text;
+    size_t write(uint8_t c) { text += (char)c; return 1; }
+    using Print::write;
+};
+
+struct sample_t {
+    uint32_t seq;
+    uint32_t time;
+    uint16_t soc_tenths;
+    uint16_t mv;
+};
+
+int failures = 0;
+
+void check(bool ok, const char* what, uint32_t at) {
+    if (!ok && failures++ < 10) printf("FAIL: %s at %u\n", what, at);
+}
+
+void test_record() {
+    for (int dt = 0; dt <= (int)HISTORY_DT_MAX; dt += 31) {
+        for (int dmv = -(1 << (HISTORY_DMV_BITS - 1)); dmv < (1 << (HISTORY_DMV_BITS - 1)); dmv += 7) {
+            for (int soc = 0; soc <= 1000; soc += 97) {
+                uint32_t word = history_encode(soc, dmv, dt);
+                check(history_soc(word) == soc && history_dmv(word) == dmv && history_dt(word) == (uint32_t)dt,
+                        "record round trip", word);
+            }
+        }
+    }
+    uint32_t gap = (HISTORY_GAP_MAX << HISTORY_SOC_BITS) | HISTORY_GAP_MARK;
+    check(history_dt(gap) == HISTORY_GAP_MAX, "gap word dt", gap);
+}
+
+void test_ring() {
+    history_clear();
+    std::vector<sample_t> expected;
+    srand(1);
+    float soc = 50;
+    float vcell = 3.8f;
+    for (int i = 0; i < 4 * HISTORY_WORDS; i++) {
+        fake_now += (i % 50 == 49) ? 2000 + rand() % 100000 : 1 + rand() % 120;
+        soc = min(max(soc + (rand() % 21 - 10) / 10.0f, 0.0f), 100.0f);
+        vcell = min(max(vcell + (rand() % 201 - 100) / 1000.0f, 3.0f), 4.4f);
+        sample_t s;
+        s.seq = history_append(soc, vcell);
+        s.time = fake_now;
+        s.soc_tenths = (uint16_t)(soc * 10 + 0.5);
+        s.mv = (uint16_t)(vcell * 1000 + 0.5);
+        expected.push_back(s);
+    }
+    check(history.count == HISTORY_WORDS, "ring full", history.count);
+
+    CsvCapture csv;
+    history_dump(csv, history.samples);
+    const char* line = strchr(csv.text.c_str(), '\n') + 1;  // header
+    size_t first = expected.size() - history.samples;
+    for (size_t i = first; i < expected.size(); i++) {
+        unsigned long seq, time;
+        float soc_read, vcell_read;
+        if (sscanf(line, "%lu,%lu,%f,%f", &seq, &time, &soc_read, &vcell_read) != 4) {
+            check(false, "dump line", i);
+            break;
+        }
+        const sample_t& s = expected[i];
+        check(seq == s.seq, "seq", s.seq);
+        check(time == s.time, "time", s.seq);
+        check((int)(soc_read * 10 + 0.5) == s.soc_tenths, "soc", s.seq);
+        check((int)(vcell_read * 1000 + 0.5) == s.mv, "vcell", s.seq);
+        line = strchr(line, '\n') + 1;
+    }
+    printf("ring: %u samples in %u words after %u appends\n", history.samples, history.count, (unsigned)expected.size());
+}
+
+void bench() {
+    const int N = 1 << 16;
+    const int ROUNDS = 200;
+    static uint32_t words[N];
+    static uint16_t soc[N];
+    static int16_t dmv[N];
+    static uint16_t dt[N];
+    for (int i = 0; i < N; i++) {
+        soc[i] = rand() % 1001;
+        dmv[i] = rand() % 4096 - 2048;
+        dt[i] = rand() % 1024;
+    }
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < N; i++) words[i] = history_encode(soc[i], dmv[i], dt[i] ^ r);
+        sum += words[r];
+    }
+    auto mid = std::chrono::steady_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < N; i++) sum += history_soc(words[i]) + history_dmv(words[i]) + history_dt(words[i]);
+        words[r] ^= sum;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double total = (double)N * ROUNDS;
+    printf("encode %.0f M records/s, decode %.0f M records/s (%u)\n",
+            total / std::chrono::duration<double, std::micro>(mid - start).count(),
+            total / std::chrono::duration<double, std::micro>(end - mid).count(), sum & 1);
+
+    uint32_t naive = sizeof(history_store_t) / (3 * sizeof(float));
+    printf("%u bytes: %u packed samples (%.1fh at 1/min) vs %u naive (%.1fh)\n", (unsigned)sizeof(history_store_t),
+            HISTORY_WORDS, HISTORY_WORDS / 60.0, naive, naive / 60.0);
+}
+
+int main() {
+    test_record();
+    test_ring();
+    if (failures) {
+        printf("FAIL: %d checks\n", failures);
+        return 1;
+    }
+    bench();
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Read throughput of the battery_state() seqlock under contention, against the same snapshot
+ * behind a mutex.  One writer stores as fast as it can (far more often than battery_state_poll()
+ * ever does) while 1, 2, 4 and 8 readers copy the state.  Every field of a stored state carries
+ * the same counter, so a torn read shows up as fields that disagree and fails the run.
+ */
+#include "../firmware/electron-maintain-capacity.cpp"
+#include <vector>
+
+const int RUN_MS = 500;
+
+std::mutex baseline_lock;
+battery_state_t baseline_data;
+
+battery_state_t make_state(uint32_t k) {
+    battery_state_t state;
+    state.soc = state.vcell = state.discharge_rate = state.charge_rate = k;
+    state.updated = k;
+    return state;
+}
+
+bool torn(const battery_state_t& s) {
+    return s.vcell != s.soc || s.discharge_rate != s.soc || s.charge_rate != s.soc || s.updated != (uint32_t)s.soc;
+}
+
+/*
+ * @return Reads per second, all readers together.
+ */
+double run(int readers, bool seqlock, uint32_t& torn_reads) {
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint32_t> bad(0);
+    std::thread writer([&] {
+        for (uint32_t k = 1; !stop; k = (k + 1) % (1 << 20)) {   // stays exact as a float
+            if (seqlock) battery_state_store(make_state(k));
+            else {
+                std::lock_guard<std::mutex> lock(baseline_lock);
+                baseline_data = make_state(k);
+            }
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int i = 0; i < readers; i++) {
+        threads.push_back(std::thread([&] {
+            uint64_t n = 0;
+            while (!stop) {
+                battery_state_t state;
+                if (seqlock) state = battery_state();
+                else {
+                    std::lock_guard<std::mutex> lock(baseline_lock);
+                    state = baseline_data;
+                }
+                if (torn(state)) bad++;
+                n++;
+            }
+            reads += n;
+        }));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(RUN_MS));
+    stop = true;
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    writer.join();
+    torn_reads += bad;
+    return reads * 1000.0 / RUN_MS;
+}
+
+int main() {
+    battery_state_store(make_state(0));
+    baseline_data = make_state(0);
+    uint32_t torn_reads = 0;
+    printf("readers  seqlock (M reads/s)  mutex (M reads/s)\n");
+    for (int readers = 1; readers <= 8; readers *= 2) {
+        double s = run(readers, true, torn_reads);
+        double m = run(readers, false, torn_reads);
+        printf("%7d  %19.1f  %17.1f\n", readers, s / 1e6, m / 1e6);
+    }
+    if (torn_reads) {
+        printf("FAIL: %u torn reads\n", torn_reads);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Clusters devices by how they use their battery, and recommends a hibernate policy for each
+ * cluster, as the [p] command that sets it.
+ *
+ * Features per device, from DIAG and UPDATE:
+ *   dis      median discharge rate (%/h, DIAG dis=)
+ *   chg      median charge rate (%/h, DIAG chg=)
+ *   soc_p10  10th percentile of UPDATE SoC, how low the device usually runs
+ *   wcd_p90  90th percentile of the worst SoC drop between two checks (DIAG wcd=)
+ *
+ * The features are standardized and clustered with k-means (k-means++ seeding, fixed seed so
+ * runs repeat).  Each Lloyd pass splits the devices across threads; the points are stored per
+ * feature (structure of arrays) so the distance loop runs over consecutive devices and the
+ * compiler vectorizes it.
+ *
+ * There is no device simulator, so the policy follows from the cluster's rates the same way the
+ * firmware defaults were derived (see qualify_battery_and_hibernate() and batt_monitor):
+ *   threshold  10% floor plus 1.25x the cluster's wcd_p90, so one check interval can't cross the
+ *              floor, never below the firmware minimum of 20%
+ *   base       twice the time to charge 10% at the cluster's median charge rate
+ *   exponent   doublings until the longest hibernate covers 48 hours without charge
+ *
+ *   cluster_policy [--k 4] [--threads N] [--version 100] [--assign file] [events...]
+ */
+#include "events.h"
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+const int D = 4;                // features
+const char* FEATURE_NAMES[D] = { "dis", "chg", "soc_p10", "wcd_p90" };
+const int MIN_DIAG = 3;
+const int MIN_UPDATES = 10;
+const int MAX_PASSES = 100;
+
+const double FLOOR_SOC = 10;
+const double MIN_THRESHOLD = 20, MAX_THRESHOLD = 80;        // sleep_policy_valid()
+const double MIN_BASE = 5 * 60, MAX_BASE = 6 * 60 * 60;     // seconds
+const int MAX_EXPONENT = 10;
+const double DARK_HOURS = 48;
+
+struct samples_t {
+    std::vector<float> dis, chg, soc, wcd;
+};
+
+double quantile(std::vector<float>& v, double q) {
+    if (v.empty()) return NAN;
+    size_t i = std::min(v.size() - 1, (size_t)(q * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+struct points_t {
+    size_t n = 0;
+    std::vector<float> x[D];    // standardized, x[feature][device]
+};
+
+struct partial_t {
+    double sum[64][D];
+    size_t count[64];
+    size_t moved;
+};
+
+/*
+ * Assigns points [begin, end) to their nearest centroid and adds them up per cluster.
+ */
+void assign(const points_t& p, const float (*centroids)[D], int k, size_t begin, size_t end,
+        std::vector<int>& label, partial_t& part) {
+    const size_t BLOCK = 256;
+    float best[BLOCK];
+    int nearest[BLOCK];
+    memset(&part, 0, sizeof(part));
+    for (size_t b = begin; b < end; b += BLOCK) {
+        size_t n = std::min(BLOCK, end - b);
+        for (size_t i = 0; i < n; i++) {
+            best[i] = INFINITY;
+            nearest[i] = 0;
+        }
+        for (int c = 0; c < k; c++) {
+            const float c0 = centroids[c][0], c1 = centroids[c][1], c2 = centroids[c][2], c3 = centroids[c][3];
+            const float* x0 = &p.x[0][b];
+            const float* x1 = &p.x[1][b];
+            const float* x2 = &p.x[2][b];
+            const float* x3 = &p.x[3][b];
+            for (size_t i = 0; i < n; i++) {    // vectorized over devices
+                float d = (x0[i] - c0) * (x0[i] - c0) + (x1[i] - c1) * (x1[i] - c1)
+                        + (x2[i] - c2) * (x2[i] - c2) + (x3[i] - c3) * (x3[i] - c3);
+                int closer = -(d < best[i]);    // all ones or zero, keeps the loop branch free
+                nearest[i] = (c & closer) | (nearest[i] & ~closer);
+                best[i] = (d < best[i]) ? d : best[i];
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            int c = nearest[i];
+            if (label[b + i] != c) part.moved++;
+            label[b + i] = c;
+            part.count[c]++;
+            for (int j = 0; j < D; j++) part.sum[c][j] += p.x[j][b + i];
+        }
+    }
+}
+
+/*
+ * k-means++ seeding, then Lloyd passes until no device changes cluster.
+ */
+std::vector<int> kmeans(const points_t& p, int k, unsigned threads, float (*centroids)[D]) {
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    auto uniform = [&rng]() {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;    // xorshift64
+        return (rng >> 11) * (1.0 / 9007199254740992.0);
+    };
+    std::vector<double> dist(p.n, INFINITY);
+    size_t pick = (size_t)(uniform() * p.n);
+    for (int c = 0; c < k; c++) {
+        for (int j = 0; j < D; j++) centroids[c][j] = p.x[j][pick];
+        double total = 0;
+        for (size_t i = 0; i < p.n; i++) {
+            double d = 0;
+            for (int j = 0; j < D; j++) d += (p.x[j][i] - centroids[c][j]) * (p.x[j][i] - centroids[c][j]);
+            dist[i] = std::min(dist[i], d);
+            total += dist[i];
+        }
+        double target = uniform() * total;
+        for (pick = 0; pick + 1 < p.n && (target -= dist[pick]) > 0; pick++);
+    }
+
+    std::vector<int> label(p.n, -1);
+    std::vector<partial_t> parts(threads);
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        std::vector<std::thread> workers;
+        size_t chunk = (p.n + threads - 1) / threads;
+        for (unsigned t = 0; t < threads; t++) {
+            size_t begin = std::min(p.n, t * chunk), end = std::min(p.n, begin + chunk);
+            workers.emplace_back(assign, std::cref(p), centroids, k, begin, end, std::ref(label), std::ref(parts[t]));
+        }
+        for (auto& w : workers) w.join();
+        size_t moved = 0;
+        for (int c = 0; c < k; c++) {
+            double sum[D] = { 0 };
+            size_t count = 0;
+            for (const partial_t& part : parts) {
+                count += part.count[c];
+                for (int j = 0; j < D; j++) sum[j] += part.sum[c][j];
+            }
+            if (count) for (int j = 0; j < D; j++) centroids[c][j] = sum[j] / count;   // empty ones stay put
+        }
+        for (const partial_t& part : parts) moved += part.moved;
+        if (moved == 0) break;
+    }
+    return label;
+}
+
+int main(int argc, char** argv) {
+    int k = 4;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    int version = 100;
+    const char* assign_file = NULL;
+    int first = 1;
+    for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        if (strcmp(argv[first], "--k") == 0) k = atoi(argv[first + 1]);
+        else if (strcmp(argv[first], "--threads") == 0) threads = std::max(1, atoi(argv[first + 1]));
+        else if (strcmp(argv[first], "--version") == 0) version = atoi(argv[first + 1]);
+        else if (strcmp(argv[first], "--assign") == 0) assign_file = argv[first + 1];
+        else break;
+    }
+    if (k < 1 || k > 64 || (first < argc && strncmp(argv[first], "--", 2) == 0)) {
+        fprintf(stderr, "usage: %s [--k 1-64] [--threads n] [--version n] [--assign file] [events...]\n", argv[0]);
+        return 2;
+    }
+
+    std::unordered_map<std::string, samples_t> samples;
+    bool ok = read_events(argc, argv, first, [&](const event_t& ev) {
+        if (event_is(ev, "DIAG")) {
+            samples_t& s = samples[std::string(ev.device)];
+            double dis = event_field(ev, "dis"), chg = event_field(ev, "chg"), wcd = event_field(ev, "wcd");
+            if (!isnan(dis)) s.dis.push_back(dis);
+            if (!isnan(chg)) s.chg.push_back(chg);
+            if (!isnan(wcd)) s.wcd.push_back(wcd);
+        }
+        else if (event_is(ev, "UPDATE")) {
+            double soc, vcell;
+            if (event_stats(ev, soc, vcell)) samples[std::string(ev.device)].soc.push_back(soc);
+        }
+    });
+    if (!ok) return 1;
+
+    std::vector<std::string> ids;
+    std::vector<float> raw[D];
+    for (auto& d : samples) {
+        samples_t& s = d.second;
+        // DIAG from before the rates were added has no dis=/chg=, and a NaN feature would poison k-means
+        if ((int)s.wcd.size() < MIN_DIAG || (int)s.soc.size() < MIN_UPDATES || s.dis.empty() || s.chg.empty()) continue;
+        ids.push_back(d.first);
+        raw[0].push_back(quantile(s.dis, 0.5));
+        raw[1].push_back(quantile(s.chg, 0.5));
+        raw[2].push_back(quantile(s.soc, 0.1));
+        raw[3].push_back(quantile(s.wcd, 0.9));
+    }
+    points_t p;
+    p.n = ids.size();
+    if (p.n < (size_t)k) {
+        fprintf(stderr, "%zu devices with %d+ DIAG (with rates) and %d+ UPDATE, need at least k=%d\n", p.n, MIN_DIAG,
+                MIN_UPDATES, k);
+        return 1;
+    }
+    for (int j = 0; j < D; j++) {
+        double mean = 0, var = 0;
+        for (float v : raw[j]) mean += v;
+        mean /= p.n;
+        for (float v : raw[j]) var += (v - mean) * (v - mean);
+        double sd = sqrt(var / p.n);
+        if (sd == 0) sd = 1;
+        for (float v : raw[j]) p.x[j].push_back((v - mean) / sd);
+    }
+
+    float centroids[64][D];
+    std::vector<int> label = kmeans(p, k, threads, centroids);
+
+    printf("cluster,devices,dis,chg,soc_p10,wcd_p90,policy\n");
+    for (int c = 0; c < k; c++) {
+        std::vector<float> member[D];
+        for (size_t i = 0; i < p.n; i++) {
+            if (label[i] != c) continue;
+            for (int j = 0; j < D; j++) member[j].push_back(raw[j][i]);
+        }
+        if (member[0].empty()) continue;
+        double median[D];
+        for (int j = 0; j < D; j++) median[j] = quantile(member[j], 0.5);
+        double wcd_p90 = quantile(member[3], 0.9);
+        double threshold = std::min(MAX_THRESHOLD, std::max(MIN_THRESHOLD, ceil(FLOOR_SOC + 1.25 * wcd_p90)));
+        double base = (median[1] > 0) ? 2 * 10 / median[1] * 3600 : MAX_BASE;
+        base = std::min(MAX_BASE, std::max(MIN_BASE, 60 * round(base / 60)));
+        int exponent = std::min(MAX_EXPONENT, std::max(0, (int)ceil(log2(DARK_HOURS * 3600 / base))));
+        printf("%d,%zu,%.2f,%.2f,%.1f,%.2f,p %.0f,%.0f,%d,%d\n", c, member[0].size(), median[0], median[1], median[2],
+                wcd_p90, threshold, base, exponent, version + c);
+    }
+
+    if (assign_file != NULL) {
+        FILE* out = fopen(assign_file, "w");
+        if (out == NULL) {
+            fprintf(stderr, "can't write %s\n", assign_file);
+            return 1;
+        }
+        fprintf(out, "device,cluster");
+        for (int j = 0; j < D; j++) fprintf(out, ",%s", FEATURE_NAMES[j]);
+        fprintf(out, "\n");
+        for (size_t i = 0; i < p.n; i++) {
+            fprintf(out, "%s,%d", ids[i].c_str(), label[i]);
+            for (int j = 0; j < D; j++) fprintf(out, ",%.2f", raw[j][i]);
+            fprintf(out, "\n");
+        }
+        fclose(out);
+    }
+    fprintf(stderr, "%zu devices clustered, %zu skipped for too little data\n", p.n, samples.size() - p.n);
+    return 0;
+}
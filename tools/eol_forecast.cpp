@@ -0,0 +1,175 @@
+/*
+ * Battery end-of-life forecast - which devices need a new battery, and by when.
+ *
+ * batt_monitor checks every 24 minutes and has to catch the battery between the threshold and
+ * 10% below it, so a device is at end of life once the worst SoC drop between two checks
+ * (DIAG wcd=) reaches that 10% margin: the capacity has faded so far that the same load eats the
+ * margin in one interval.  Internal resistance shows up as the VCell sag under modem load (DIAG
+ * sag=), and past the sag limit a transmit near the threshold browns out before the check runs.
+ *
+ * Per device, the daily maximum of both goes into a least squares fit against time, and the
+ * forecast is the first day either fit crosses its limit.  Devices are fitted in parallel.  The
+ * output is a CSV replacement schedule, most urgent first:
+ *
+ *   eol_forecast [--margin 10] [--sag-limit 300] [--min-days 7] [--horizon 730] [--threads N] [events...]
+ *
+ * Forecasts further out than the horizon (days) are too flat to trust and count as no trend.
+ */
+#include "events.h"
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+const double DAY = 24 * 60 * 60;
+
+struct day_t {
+    double wcd = NAN;   // worst SoC drop between checks (%)
+    double sag = NAN;   // VCell sag under modem load (mV)
+};
+
+struct device_t {
+    std::string id;
+    std::map<int32_t, day_t> days;
+};
+
+struct fit_t {
+    int n = 0;
+    double slope = 0;       // per day
+    double value = NAN;     // fitted value on the last day
+};
+
+struct forecast_t {
+    const device_t* device;
+    fit_t wcd;
+    fit_t sag;
+    double days_left;       // INFINITY without a rising trend
+    const char* limit;
+    double headroom;        // fraction of the limit left, to rank devices without a trend
+};
+
+/*
+ * Ordinary least squares of y over the day number, skipping days without a value.
+ */
+template <typename Y>
+fit_t fit_trend(const std::map<int32_t, day_t>& days, Y y) {
+    fit_t fit;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int32_t x0 = days.empty() ? 0 : days.rbegin()->first;   // keeps the sums small
+    for (const auto& d : days) {
+        double v = y(d.second);
+        if (isnan(v)) continue;
+        double x = d.first - x0;
+        fit.n++;
+        sx += x;
+        sy += v;
+        sxx += x * x;
+        sxy += x * v;
+    }
+    if (fit.n == 0) return fit;
+    double denom = fit.n * sxx - sx * sx;
+    fit.slope = (fit.n > 1 && denom > 0) ? (fit.n * sxy - sx * sy) / denom : 0;
+    fit.value = (sy - fit.slope * sx) / fit.n;   // intercept, at the last day
+    return fit;
+}
+
+/*
+ * Days until the fit reaches `limit`, 0 if it already has.
+ */
+double days_to(const fit_t& fit, double limit) {
+    if (fit.n == 0) return INFINITY;
+    if (fit.value >= limit) return 0;
+    return (fit.slope > 0) ? (limit - fit.value) / fit.slope : INFINITY;
+}
+
+int main(int argc, char** argv) {
+    double margin = 10;
+    double sag_limit = 300;
+    int min_days = 7;
+    double horizon = 730;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    int first = 1;
+    for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        if (strcmp(argv[first], "--margin") == 0) margin = atof(argv[first + 1]);
+        else if (strcmp(argv[first], "--sag-limit") == 0) sag_limit = atof(argv[first + 1]);
+        else if (strcmp(argv[first], "--min-days") == 0) min_days = atoi(argv[first + 1]);
+        else if (strcmp(argv[first], "--horizon") == 0) horizon = atof(argv[first + 1]);
+        else if (strcmp(argv[first], "--threads") == 0) threads = std::max(1, atoi(argv[first + 1]));
+        else {
+            fprintf(stderr, "usage: %s [--margin %%] [--sag-limit mV] [--min-days n] [--horizon days] [--threads n] [events...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::unordered_map<std::string, device_t> devices;
+    double now = 0;
+    bool ok = read_events(argc, argv, first, [&](const event_t& ev) {
+        now = std::max(now, ev.time);
+        if (!event_is(ev, "DIAG")) return;
+        double wcd = event_field(ev, "wcd");
+        double sag = event_field(ev, "sag");
+        device_t& device = devices[std::string(ev.device)];
+        day_t& day = device.days[(int32_t)floor(ev.time / DAY)];
+        if (!isnan(wcd)) day.wcd = isnan(day.wcd) ? wcd : std::max(day.wcd, wcd);
+        if (!isnan(sag) && sag > 0) day.sag = isnan(day.sag) ? sag : std::max(day.sag, sag);  // 0 until a boot measured it
+    });
+    if (!ok) return 1;
+
+    std::vector<forecast_t> forecasts;
+    for (auto& d : devices) {
+        d.second.id = d.first;
+        if ((int)d.second.days.size() < min_days) continue;
+        forecast_t f = {};
+        f.device = &d.second;
+        forecasts.push_back(f);
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            for (size_t i = next++; i < forecasts.size(); i = next++) {
+                forecast_t& f = forecasts[i];
+                const auto& days = f.device->days;
+                f.wcd = fit_trend(days, [](const day_t& d) { return d.wcd; });
+                f.sag = fit_trend(days, [](const day_t& d) { return d.sag; });
+                // the fits end on the device's last day, which may be before the newest data
+                double since = now / DAY - days.rbegin()->first;
+                double by_wcd = days_to(f.wcd, margin) - since;
+                double by_sag = days_to(f.sag, sag_limit) - since;
+                f.days_left = std::max(0.0, std::min(by_wcd, by_sag));
+                if (f.days_left > horizon) f.days_left = INFINITY;
+                f.limit = isinf(f.days_left) ? "-" : (by_wcd <= by_sag) ? "wcd" : "sag";
+                f.headroom = std::min(f.wcd.n ? 1 - f.wcd.value / margin : 1, f.sag.n ? 1 - f.sag.value / sag_limit : 1);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+
+    std::sort(forecasts.begin(), forecasts.end(), [](const forecast_t& a, const forecast_t& b) {
+        if (a.days_left != b.days_left) return a.days_left < b.days_left;
+        return a.headroom < b.headroom;
+    });
+
+    printf("rank,device,days_left,replace_by,limit,wcd,wcd_per_30d,sag_mv,sag_per_30d,days\n");
+    int rank = 1;
+    for (const forecast_t& f : forecasts) {
+        char days_left[16] = "-";
+        char date[16] = "-";
+        if (!isinf(f.days_left)) {
+            snprintf(days_left, sizeof(days_left), "%.0f", f.days_left);
+            time_t t = (time_t)(now + f.days_left * DAY);
+            struct tm tm;
+            strftime(date, sizeof(date), "%Y-%m-%d", gmtime_r(&t, &tm));
+        }
+        printf("%d,%s,%s,%s,%s,%.2f,%.3f,%.0f,%.1f,%zu\n", rank++, f.device->id.c_str(), days_left, date, f.limit,
+                f.wcd.value, f.wcd.slope * 30, f.sag.value, f.sag.slope * 30, f.device->days.size());
+    }
+    fprintf(stderr, "%zu devices, %zu with %d+ days of DIAG\n", devices.size(), forecasts.size(), min_days);
+    return 0;
+}
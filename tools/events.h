@@ -0,0 +1,146 @@
+/*
+ * Fleet event lines, as the host tools read them.  One event per line, tab separated:
+ *
+ *   <device id> \t <unix time (s)> \t <event name> \t <data>
+ *
+ * which is what a webhook or the SSE stream gives, with published_at converted to seconds.
+ * The data is the firmware's event text, see the Events section of the README: SoC/VCell
+ * events start with "<soc>(%),<vcell>(V)", everything else is comma separated key=value.
+ */
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <charconv>
+#include <string_view>
+
+struct event_t {
+    std::string_view device;
+    double time;
+    std::string_view name;
+    std::string_view data;
+};
+
+inline bool parse_number(std::string_view text, double& x) {
+    if (!text.empty() && text[0] == '+') text.remove_prefix(1);
+    return std::from_chars(text.data(), text.data() + text.size(), x).ec == std::errc();
+}
+
+/*
+ * @return false for blank, comment (#) or malformed lines.  `ev` points into `line`.
+ */
+inline bool parse_event(std::string_view line, event_t& ev) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.empty() || line[0] == '#') return false;
+    size_t t1 = line.find('\t');
+    size_t t2 = (t1 == std::string_view::npos) ? t1 : line.find('\t', t1 + 1);
+    size_t t3 = (t2 == std::string_view::npos) ? t2 : line.find('\t', t2 + 1);
+    if (t3 == std::string_view::npos || t1 == 0) return false;
+    if (!parse_number(line.substr(t1 + 1, t2 - t1 - 1), ev.time)) return false;
+    ev.device = line.substr(0, t1);
+    ev.name = line.substr(t2 + 1, t3 - t2 - 1);
+    ev.data = line.substr(t3 + 1);
+    return true;
+}
+
+/*
+ * "SLEEP 1440" is a SLEEP event, the duration is also in dur=.
+ */
+inline bool event_is(const event_t& ev, std::string_view name) {
+    return ev.name.substr(0, name.size()) == name
+        && (ev.name.size() == name.size() || ev.name[name.size()] == ' ');
+}
+
+/*
+ * The value of `key=` in the data, or `fallback`.
+ */
+inline double event_field(const event_t& ev, std::string_view key, double fallback = NAN) {
+    std::string_view data = ev.data;
+    while (!data.empty()) {
+        size_t comma = data.find(',');
+        std::string_view field = data.substr(0, comma);
+        if (field.size() > key.size() && field.substr(0, key.size()) == key && field[key.size()] == '=') {
+            double x;
+            return parse_number(field.substr(key.size() + 1), x) ? x : fallback;
+        }
+        if (comma == std::string_view::npos) break;
+        data.remove_prefix(comma + 1);
+    }
+    return fallback;
+}
+
+/*
+ * The leading "<soc>(%),<vcell>(V)" of UPDATE, SLEEP and WAKE.
+ */
+inline bool event_stats(const event_t& ev, double& soc, double& vcell) {
+    std::string_view data = ev.data;
+    size_t pct = data.find("(%),");
+    if (pct == std::string_view::npos || !parse_number(data.substr(0, pct), soc)) return false;
+    data.remove_prefix(pct + 4);
+    size_t volts = data.find("(V)");
+    return volts != std::string_view::npos && parse_number(data.substr(0, volts), vcell);
+}
+
+inline uint64_t device_hash(std::string_view device) {
+    uint64_t h = 1469598103934665603ull;    // FNV-1a
+    for (char c : device) h = (h ^ (uint8_t)c) * 1099511628211ull;
+    return h;
+}
+
+/*
+ * Standard base64 as the firmware's base64_encode() writes it, padding optional.
+ * @return false on a character outside the alphabet.
+ */
+template <typename Bytes>
+bool base64_decode(std::string_view text, Bytes& out) {
+    uint32_t bits = 0;
+    int n = 0;
+    for (char c : text) {
+        int v = (c >= 'A' && c <= 'Z') ? c - 'A' : (c >= 'a' && c <= 'z') ? c - 'a' + 26
+              : (c >= '0' && c <= '9') ? c - '0' + 52 : (c == '+') ? 62 : (c == '/') ? 63 : -1;
+        if (c == '=') break;
+        if (v < 0) return false;
+        bits = (bits << 6) | v;
+        if ((n += 6) >= 8) out.push_back((uint8_t)(bits >> (n -= 8)));
+    }
+    return true;
+}
+
+/*
+ * Calls fn(std::string_view) for every line of `in`, without the newline.
+ */
+template <typename F>
+void read_lines(FILE* in, F fn) {
+    char* buf = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&buf, &cap, in)) > 0) {
+        if (buf[n - 1] == '\n') n--;
+        fn(std::string_view(buf, n));
+    }
+    free(buf);
+}
+
+/*
+ * Every event in the files named on the command line from argv[first] on, or stdin if none.
+ * @return false if a file can't be opened.
+ */
+template <typename F>
+bool read_events(int argc, char** argv, int first, F fn) {
+    auto each = [&](std::string_view line) {
+        event_t ev;
+        if (parse_event(line, ev)) fn(ev);
+    };
+    if (first >= argc) read_lines(stdin, each);
+    for (int i = first; i < argc; i++) {
+        FILE* in = fopen(argv[i], "r");
+        if (in == NULL) {
+            fprintf(stderr, "can't open %s\n", argv[i]);
+            return false;
+        }
+        read_lines(in, each);
+        fclose(in);
+    }
+    return true;
+}
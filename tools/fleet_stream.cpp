@@ -0,0 +1,519 @@
+/*
+ * Live fleet views from the event stream - per site SoC percentiles, devices sleeping and
+ * publish rate, over tumbling and sliding windows of event time.
+ *
+ * Reads event lines (see events.h) from stdin, e.g. a named pipe the webhook receiver writes to:
+ *
+ *   fleet_stream [--pane 60] [--window 300] [--lateness 5] [--workers N] [--sites file] < pipe
+ *   fleet_stream --bench <events> [--devices 100000] [--workers N]
+ *
+ *   reader ──(lines batched per shard)──> shard queue ─> worker ─┐
+ *          ──(watermarks to every shard)─> ...                  ├─> result queue ─> aggregator ─> stdout
+ *                                          shard queue ─> worker ─┘
+ *
+ * The reader only finds the device and time of each line, and batches lines per shard (device
+ * hash), so one device's events always go to the same worker, in order.  Workers own their
+ * devices' state (site, asleep until) and per-pane partial aggregates, so they share nothing.
+ * Queues are bounded lock-free MPMC rings (Vyukov); a full queue makes its producer wait, which
+ * is the backpressure.
+ *
+ * Windows are in event time.  Tumbling windows ("panes", --pane seconds) close when the reader's
+ * watermark, the newest event time minus --lateness, passes their end; the reader sends the
+ * watermark down every shard queue behind the lines before it, so a worker has seen all of its
+ * events for a pane when the watermark arrives.  Later events are counted as late and dropped.
+ * Each worker reports every closed pane, and once all have, the aggregator merges them (SoC
+ * histograms add up exactly) and prints the pane, plus the sliding window (--window seconds,
+ * a whole number of panes) that ends with it once there are enough panes to fill one.
+ *
+ * A device is sleeping from its SLEEP event until dur= has passed or it sends WAKE; the count
+ * is taken at the end of each window.  Sites come from a "device,site" CSV, or it's one site.
+ *
+ * Output CSV: window_end,window,site,events,updates,publish_rate,soc_p10,soc_p50,soc_p90,sleeping
+ */
+#include "events.h"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Bounded multi-producer multi-consumer queue, after Dmitry Vyukov's.  Every cell carries a
+ * sequence number that says whether it is ready for the producer or the consumer of a given
+ * lap, so producers and consumers only contend on their own position counter.
+ */
+template <typename T>
+class mpmc_queue {
+public:
+    explicit mpmc_queue(size_t capacity) : mask(capacity - 1), cells(new cell_t[capacity]) {
+        for (size_t i = 0; i < capacity; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            cell_t& cell = cells[pos & mask];
+            intptr_t diff = (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;    // full
+            else pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T& value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            cell_t& cell = cells[pos & mask];
+            intptr_t diff = (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;    // empty
+            else pos = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    void push(T value) {
+        for (int spins = 0; !try_push(value); spins++) backoff(spins);
+    }
+
+    T pop() {
+        T value;
+        for (int spins = 0; !try_pop(value); spins++) backoff(spins);
+        return value;
+    }
+
+private:
+    struct cell_t {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    static void backoff(int spins) {
+        if (spins < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));    // idle stream, don't burn a core
+    }
+
+    const size_t mask;
+    std::unique_ptr<cell_t[]> cells;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<size_t> head{0};
+};
+
+const int SOC_BINS = 200;               // 0.5% each
+const size_t BATCH_BYTES = 16 * 1024;
+const size_t SHARD_QUEUE = 256;         // batches
+const size_t RESULT_QUEUE = 4096;       // pane partials
+
+/*
+ * Reader to worker: a batch of lines, or a watermark, or the end of the stream.
+ */
+struct message_t {
+    std::string lines;
+    bool watermark = false;
+    int64_t first_pane = 0;
+    int64_t closed_before = 0;      // with a watermark, panes before this one are complete
+    bool end = false;               // the last watermark, closes every pane
+};
+
+struct site_pane_t {
+    uint64_t events = 0;
+    uint64_t updates = 0;
+    uint32_t sleeping = 0;
+    uint32_t soc[SOC_BINS] = {};
+
+    void add(const site_pane_t& o) {
+        events += o.events;
+        updates += o.updates;
+        sleeping += o.sleeping;
+        for (int i = 0; i < SOC_BINS; i++) soc[i] += o.soc[i];
+    }
+};
+
+/*
+ * Worker to aggregator: one worker's share of one pane.
+ */
+struct partial_t {
+    int64_t pane;
+    std::vector<site_pane_t> sites;
+};
+
+struct config_t {
+    double pane = 60;
+    int window_panes = 5;
+    double lateness = 5;
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    std::unordered_map<std::string, int> site_of;
+    std::vector<std::string> site_names = { "fleet" };
+    bool quiet = false;
+};
+
+struct stats_t {
+    std::atomic<uint64_t> events{0};
+    std::atomic<uint64_t> late{0};
+    std::atomic<uint64_t> bad{0};
+    std::atomic<uint64_t> windows{0};
+};
+
+struct device_t {
+    int site;
+    double asleep_from = 0;
+    double asleep_until = 0;
+};
+
+void worker(const config_t& cfg, mpmc_queue<message_t*>& in, mpmc_queue<partial_t*>& out, stats_t& stats) {
+    std::unordered_map<std::string, device_t> devices;
+    std::map<int64_t, partial_t*> open;
+    int64_t next_close = INT64_MIN;     // first pane not reported yet
+    std::string key;
+    uint64_t events = 0, late = 0, bad = 0;
+
+    auto pane_of = [&](int64_t pane) -> partial_t* {
+        auto it = open.find(pane);
+        if (it != open.end()) return it->second;
+        partial_t* p = new partial_t{ pane, std::vector<site_pane_t>(cfg.site_names.size()) };
+        open[pane] = p;
+        return p;
+    };
+
+    for (;;) {
+        message_t* msg = in.pop();
+        if (msg->watermark) {
+            if (next_close == INT64_MIN) next_close = msg->first_pane;
+            for (; next_close < msg->closed_before; next_close++) {
+                partial_t* p = pane_of(next_close);
+                open.erase(next_close);
+                double end = (next_close + 1) * cfg.pane;
+                for (const auto& d : devices) {
+                    if (d.second.asleep_from < end && d.second.asleep_until > end) p->sites[d.second.site].sleeping++;
+                }
+                out.push(p);
+            }
+            bool end = msg->end;
+            delete msg;
+            if (end) break;
+            continue;
+        }
+
+        std::string_view lines = msg->lines;
+        while (!lines.empty()) {
+            size_t nl = lines.find('\n');
+            std::string_view line = lines.substr(0, nl);
+            lines.remove_prefix(nl == std::string_view::npos ? lines.size() : nl + 1);
+            event_t ev;
+            if (!parse_event(line, ev)) {
+                bad++;
+                continue;
+            }
+            events++;
+            int64_t pane = (int64_t)floor(ev.time / cfg.pane);
+            if (next_close != INT64_MIN && pane < next_close) {
+                late++;
+                continue;
+            }
+            key.assign(ev.device);
+            auto it = devices.find(key);
+            if (it == devices.end()) {
+                auto site = cfg.site_of.find(key);
+                it = devices.emplace(key, device_t{ site == cfg.site_of.end() ? 0 : site->second }).first;
+            }
+            device_t& dev = it->second;
+            site_pane_t& sp = pane_of(pane)->sites[dev.site];
+            sp.events++;
+            if (event_is(ev, "UPDATE")) {
+                double soc, vcell;
+                if (event_stats(ev, soc, vcell)) {
+                    sp.updates++;
+                    sp.soc[std::min(SOC_BINS - 1, std::max(0, (int)(soc * SOC_BINS / 100)))]++;
+                }
+                dev.asleep_until = std::min(dev.asleep_until, ev.time);
+            }
+            else if (event_is(ev, "SLEEP")) {
+                dev.asleep_from = ev.time;
+                dev.asleep_until = ev.time + event_field(ev, "dur", 0);
+            }
+            else if (event_is(ev, "WAKE")) {
+                dev.asleep_until = std::min(dev.asleep_until, ev.time);
+            }
+        }
+        delete msg;
+    }
+    stats.events += events;
+    stats.late += late;
+    stats.bad += bad;
+}
+
+double percentile(const uint32_t* bins, uint64_t total, double q) {
+    if (total == 0) return NAN;
+    double target = q * total;
+    uint64_t below = 0;
+    for (int i = 0; i < SOC_BINS; i++) {
+        if (bins[i] > 0 && below + bins[i] >= target) return (i + (target - below) / bins[i]) * 100.0 / SOC_BINS;
+        below += bins[i];
+    }
+    return 100;
+}
+
+void print_window(const config_t& cfg, stats_t& stats, double end, double seconds, const std::vector<site_pane_t>& sites) {
+    stats.windows++;
+    if (cfg.quiet) return;
+    for (size_t s = 0; s < sites.size(); s++) {
+        const site_pane_t& sp = sites[s];
+        printf("%.0f,%.0fs,%s,%llu,%llu,%.2f,%.1f,%.1f,%.1f,%u\n", end, seconds, cfg.site_names[s].c_str(),
+                (unsigned long long)sp.events, (unsigned long long)sp.updates, sp.events / seconds,
+                percentile(sp.soc, sp.updates, 0.1), percentile(sp.soc, sp.updates, 0.5),
+                percentile(sp.soc, sp.updates, 0.9), sp.sleeping);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Merges pane partials as they come in, and prints each pane and its sliding window once every
+ * worker has reported it.
+ */
+void aggregator(const config_t& cfg, mpmc_queue<partial_t*>& in, stats_t& stats) {
+    std::map<int64_t, std::pair<unsigned, std::vector<site_pane_t>>> pending;
+    std::deque<std::vector<site_pane_t>> window;
+    for (;;) {
+        partial_t* p = in.pop();
+        if (p == nullptr) break;
+        auto& slot = pending[p->pane];
+        if (slot.second.empty()) slot.second.resize(cfg.site_names.size());
+        for (size_t s = 0; s < p->sites.size(); s++) slot.second[s].add(p->sites[s]);
+        slot.first++;
+        delete p;
+        // panes complete in order, every worker closes them in order
+        while (!pending.empty() && pending.begin()->second.first == cfg.workers) {
+            int64_t pane = pending.begin()->first;
+            std::vector<site_pane_t>& sites = pending.begin()->second.second;
+            double end = (pane + 1) * cfg.pane;
+            print_window(cfg, stats, end, cfg.pane, sites);
+            window.push_back(sites);
+            if ((int)window.size() > cfg.window_panes) window.pop_front();
+            if (cfg.window_panes > 1 && (int)window.size() == cfg.window_panes) {
+                std::vector<site_pane_t> sum(cfg.site_names.size());
+                for (const auto& w : window) for (size_t s = 0; s < sum.size(); s++) sum[s].add(w[s]);
+                for (size_t s = 0; s < sum.size(); s++) sum[s].sleeping = sites[s].sleeping;   // at the window end
+                print_window(cfg, stats, end, cfg.pane * cfg.window_panes, sum);
+            }
+            pending.erase(pending.begin());
+        }
+    }
+}
+
+/*
+ * Feeds lines to the shards.  `next` returns false at the end of the stream.
+ */
+template <typename NEXT>
+void reader(const config_t& cfg, std::vector<std::unique_ptr<mpmc_queue<message_t*>>>& shards, stats_t& stats, NEXT next) {
+    std::vector<message_t*> batches(cfg.workers);
+    for (auto& b : batches) b = new message_t;
+    bool started = false;
+    int64_t first_pane = 0, closed_before = 0;
+    double newest = -INFINITY;
+    auto flush = [&](unsigned s) {
+        if (batches[s]->lines.empty()) return;
+        shards[s]->push(batches[s]);
+        batches[s] = new message_t;
+    };
+    auto broadcast = [&](bool end) {
+        for (unsigned s = 0; s < cfg.workers; s++) {
+            flush(s);
+            message_t* wm = new message_t;
+            wm->watermark = true;
+            wm->first_pane = first_pane;
+            wm->closed_before = closed_before;
+            wm->end = end;
+            shards[s]->push(wm);
+        }
+    };
+
+    std::string_view line;
+    while (next(line)) {
+        size_t t1 = line.find('\t');
+        size_t t2 = (t1 == std::string_view::npos) ? t1 : line.find('\t', t1 + 1);
+        double time;
+        if (t2 == std::string_view::npos || !parse_number(line.substr(t1 + 1, t2 - t1 - 1), time)) {
+            if (!line.empty() && line[0] != '#') stats.bad++;
+            continue;
+        }
+        if (!started) {
+            started = true;
+            first_pane = closed_before = (int64_t)floor(time / cfg.pane);
+        }
+        if (time > newest) {
+            newest = time;
+            int64_t watermark = (int64_t)floor((newest - cfg.lateness) / cfg.pane);
+            if (watermark > closed_before) {
+                closed_before = watermark;
+                broadcast(false);
+            }
+        }
+        unsigned s = device_hash(line.substr(0, t1)) % cfg.workers;
+        message_t* b = batches[s];
+        b->lines.append(line.data(), line.size());
+        b->lines.push_back('\n');
+        if (b->lines.size() >= BATCH_BYTES) flush(s);
+    }
+    closed_before = started ? (int64_t)floor(newest / cfg.pane) + 1 : 0;
+    broadcast(true);
+    for (auto& b : batches) delete b;
+}
+
+/*
+ * Runs the whole pipeline over the lines `next` returns.
+ */
+template <typename NEXT>
+void run(const config_t& cfg, stats_t& stats, NEXT next) {
+    std::vector<std::unique_ptr<mpmc_queue<message_t*>>> shards;
+    for (unsigned s = 0; s < cfg.workers; s++) shards.emplace_back(new mpmc_queue<message_t*>(SHARD_QUEUE));
+    mpmc_queue<partial_t*> results(RESULT_QUEUE);
+
+    std::thread agg(aggregator, std::cref(cfg), std::ref(results), std::ref(stats));
+    std::vector<std::thread> workers;
+    for (unsigned s = 0; s < cfg.workers; s++) {
+        workers.emplace_back(worker, std::cref(cfg), std::ref(*shards[s]), std::ref(results), std::ref(stats));
+    }
+    reader(cfg, shards, stats, next);
+    for (auto& w : workers) w.join();
+    results.push(nullptr);
+    agg.join();
+}
+
+/*
+ * Synthetic fleet for --bench: every device publishes an UPDATE a minute, with a DIAG an hour
+ * and a SLEEP / WAKE pair now and then, over 10 sites.
+ */
+std::string generate(uint64_t events, uint32_t devices, config_t& cfg) {
+    std::string text;
+    text.reserve(events * 64);
+    char id[16], line[128];
+    uint64_t rng = 88172645463325252ull;
+    auto next_rand = [&rng]() { rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17; return rng; };
+    cfg.site_names.clear();
+    for (int s = 0; s < 10; s++) cfg.site_names.push_back("site" + std::to_string(s));
+    for (uint32_t d = 0; d < devices; d++) {
+        snprintf(id, sizeof(id), "e%08x", d * 2654435761u);
+        cfg.site_of[id] = d % 10;
+    }
+    double t0 = 1700000000;
+    for (uint64_t i = 0; i < events; i++) {
+        uint32_t d = i % devices;
+        double t = t0 + (double)(i / devices) * 60 + (double)d * 60 / devices;
+        snprintf(id, sizeof(id), "e%08x", d * 2654435761u);
+        uint64_t r = next_rand();
+        double soc = 20 + (r % 8000) / 100.0;
+        int n;
+        if (r % 997 == 0) n = snprintf(line, sizeof(line), "%s\t%.0f\tSLEEP 1440\t%.2f(%%),3.61(V),dur=1440,att=1,thr=20.0\n", id, t, soc);
+        else if (r % 997 == 1) n = snprintf(line, sizeof(line), "%s\t%.0f\tWAKE\t%.2f(%%),3.70(V),rr=140,wk=timer,att=1,pol=0\n", id, t, soc);
+        else if (r % 60 == 0) n = snprintf(line, sizeof(line), "%s\t%.0f\tDIAG\tcyc=1.00,low=0,dod=0/0/0/0/0,wcd=3.10,sag=120,dis=1.20,chg=3.40,pol=0\n", id, t);
+        else n = snprintf(line, sizeof(line), "%s\t%.0f\tUPDATE\t%.2f(%%),3.80(V),up=%llu,seq=%llu\n", id, t, soc,
+                (unsigned long long)i / devices * 60, (unsigned long long)i / devices);
+        text.append(line, n);
+    }
+    return text;
+}
+
+bool load_sites(const char* path, config_t& cfg) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) return false;
+    cfg.site_names.clear();
+    std::unordered_map<std::string, int> ids;
+    read_lines(in, [&](std::string_view line) {
+        size_t comma = line.find(',');
+        if (comma == std::string_view::npos) return;
+        std::string site(line.substr(comma + 1));
+        auto it = ids.find(site);
+        if (it == ids.end()) {
+            it = ids.emplace(site, (int)cfg.site_names.size()).first;
+            cfg.site_names.push_back(site);
+        }
+        cfg.site_of[std::string(line.substr(0, comma))] = it->second;
+    });
+    fclose(in);
+    if (cfg.site_names.empty()) cfg.site_names.push_back("fleet");
+    return true;
+}
+
+int main(int argc, char** argv) {
+    config_t cfg;
+    double window = 300;
+    uint64_t bench = 0;
+    uint32_t devices = 100000;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "usage: %s [--pane s] [--window s] [--lateness s] [--workers n] [--sites file]\n"
+                    "       %s --bench <events> [--devices n] [--workers n]\n", argv[0], argv[0]);
+            return 2;
+        }
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--pane") == 0) cfg.pane = std::max(1.0, atof(value));
+        else if (strcmp(argv[i], "--window") == 0) window = atof(value);
+        else if (strcmp(argv[i], "--lateness") == 0) cfg.lateness = std::max(0.0, atof(value));
+        else if (strcmp(argv[i], "--workers") == 0) cfg.workers = std::max(1, atoi(value));
+        else if (strcmp(argv[i], "--bench") == 0) bench = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "--devices") == 0) devices = std::max(1, atoi(value));
+        else if (strcmp(argv[i], "--sites") == 0) {
+            if (!load_sites(value, cfg)) {
+                fprintf(stderr, "can't open %s\n", value);
+                return 1;
+            }
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    cfg.window_panes = std::max(1, (int)round(window / cfg.pane));
+    stats_t stats;
+
+    if (bench > 0) {
+        cfg.quiet = true;
+        std::string text = generate(bench, devices, cfg);
+        std::string_view rest = text;
+        auto start = std::chrono::steady_clock::now();
+        run(cfg, stats, [&rest](std::string_view& line) {
+            if (rest.empty()) return false;
+            size_t nl = rest.find('\n');
+            line = rest.substr(0, nl);
+            rest.remove_prefix(nl + 1);
+            return true;
+        });
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%llu events, %u devices, %u workers: %.2fs, %.2fM events/s, %llu windows\n",
+                (unsigned long long)stats.events.load(), devices, cfg.workers, secs, stats.events / secs / 1e6,
+                (unsigned long long)stats.windows.load());
+        return 0;
+    }
+
+    printf("window_end,window,site,events,updates,publish_rate,soc_p10,soc_p50,soc_p90,sleeping\n");
+    char* buf = NULL;
+    size_t cap = 0;
+    run(cfg, stats, [&](std::string_view& line) {
+        ssize_t n = getline(&buf, &cap, stdin);
+        if (n <= 0) return false;
+        if (buf[n - 1] == '\n') n--;
+        line = std::string_view(buf, n);
+        return true;
+    });
+    free(buf);
+    fprintf(stderr, "%llu events, %llu late, %llu malformed\n", (unsigned long long)stats.events.load(),
+            (unsigned long long)stats.late.load(), (unsigned long long)stats.bad.load());
+    return 0;
+}
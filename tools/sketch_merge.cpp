@@ -0,0 +1,185 @@
+/*
+ * Merges the daily SKETCH events into per device and fleet distributions of SoC and VCell.
+ *
+ *   SKETCH s|v,<period start>,<n>,<mean>,<sd>,<min>,<max>,<base64 uint16 bin counts, little endian>
+ *
+ * SoC has 50 bins of 2%, VCell 64 bins of 25mV from 3000mV (see sketch_add() in the firmware), so
+ * bins merge exactly by adding counts, and the moments combine with the parallel variance formula.
+ * Sketches are merged per device and UTC day of their period start (a reboot can split a day into
+ * several), a copy of the same sketch delivered twice counts once, and the devices' days are
+ * merged again into the fleet per day and over all days.  Quantiles are interpolated within their
+ * bin like [k] does, so they are good to a bin width.
+ *
+ *   sketch_merge [--devices] [events...]
+ *
+ * prints one CSV row per day and signal for the fleet, and with --devices for every device too.
+ */
+#include "events.h"
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+const double DAY = 24 * 60 * 60;
+const int SIGNALS = 2;
+const char SIGNAL_KEYS[SIGNALS] = { 's', 'v' };
+const char* SIGNAL_NAMES[SIGNALS] = { "soc", "vcell_mv" };
+const int NUM_BINS[SIGNALS] = { 50, 64 };
+const double BIN_LO[SIGNALS] = { 0, 3000 };
+const double BIN_WIDTH[SIGNALS] = { 2, 25 };
+const int MAX_BINS = 64;
+const double QUANTILES[] = { 0.01, 0.05, 0.5, 0.95, 0.99 };
+
+struct dist_t {
+    uint64_t n = 0;
+    double mean = 0;
+    double m2 = 0;          // sum of squared differences from the mean
+    double min = INFINITY;
+    double max = -INFINITY;
+    uint64_t bins[MAX_BINS] = { 0 };
+    int sources = 0;        // sketches or devices merged into it
+
+    void merge(const dist_t& o) {
+        if (o.n == 0) return;
+        double delta = o.mean - mean;
+        uint64_t total = n + o.n;
+        mean += delta * o.n / total;
+        m2 += o.m2 + delta * delta * n * o.n / total;
+        n = total;
+        min = std::min(min, o.min);
+        max = std::max(max, o.max);
+        for (int i = 0; i < MAX_BINS; i++) bins[i] += o.bins[i];
+        sources += o.sources;
+    }
+
+    double sd() const {
+        return (n > 1) ? sqrt(m2 / (n - 1)) : 0;
+    }
+
+    /*
+     * The value below which a fraction q of the samples fall, as sketch_quantile() in the firmware.
+     */
+    double quantile(int signal, double q) const {
+        uint64_t total = 0;
+        for (int i = 0; i < NUM_BINS[signal]; i++) total += bins[i];
+        if (total == 0) return NAN;
+        double target = q * total;
+        uint64_t below = 0;
+        for (int i = 0; i < NUM_BINS[signal]; i++) {
+            if (bins[i] > 0 && below + bins[i] >= target) {
+                return BIN_LO[signal] + BIN_WIDTH[signal] * (i + (target - below) / bins[i]);
+            }
+            below += bins[i];
+        }
+        return BIN_LO[signal] + BIN_WIDTH[signal] * NUM_BINS[signal];
+    }
+};
+
+/*
+ * One SKETCH event's data.  @return false if it's malformed.
+ */
+bool parse_sketch(std::string_view data, int& signal, double& start, dist_t& d) {
+    std::string_view fields[8];
+    for (int i = 0; i < 8; i++) {
+        size_t comma = (i < 7) ? data.find(',') : std::string_view::npos;
+        if (i < 7 && comma == std::string_view::npos) return false;
+        fields[i] = data.substr(0, comma);
+        data.remove_prefix((i < 7) ? comma + 1 : data.size());
+    }
+    if (fields[0].size() != 1) return false;
+    signal = (fields[0][0] == SIGNAL_KEYS[0]) ? 0 : (fields[0][0] == SIGNAL_KEYS[1]) ? 1 : -1;
+    double n, mean, sd;
+    if (signal < 0 || !parse_number(fields[1], start) || !parse_number(fields[2], n) || !parse_number(fields[3], mean)
+            || !parse_number(fields[4], sd) || !parse_number(fields[5], d.min) || !parse_number(fields[6], d.max)) {
+        return false;
+    }
+    std::vector<uint8_t> bytes;
+    if (!base64_decode(fields[7], bytes) || (int)bytes.size() != NUM_BINS[signal] * 2) return false;
+    for (int i = 0; i < NUM_BINS[signal]; i++) d.bins[i] = bytes[2 * i] | bytes[2 * i + 1] << 8;
+    d.n = (uint64_t)n;
+    d.mean = mean;
+    d.m2 = (n > 1) ? sd * sd * (n - 1) : 0;
+    d.sources = 1;
+    return d.n > 0;
+}
+
+void print_row(const char* scope, const char* day, int signal, const dist_t& d) {
+    printf("%s,%s,%s,%d,%llu,%.1f,%.1f,%.1f,%.1f", scope, day, SIGNAL_NAMES[signal], d.sources,
+            (unsigned long long)d.n, d.mean, d.sd(), d.min, d.max);
+    for (double q : QUANTILES) printf(",%.1f", d.quantile(signal, q));
+    printf("\n");
+}
+
+std::string day_name(int32_t day) {
+    char date[16];
+    time_t t = (time_t)(day * DAY);
+    struct tm tm;
+    strftime(date, sizeof(date), "%Y-%m-%d", gmtime_r(&t, &tm));
+    return date;
+}
+
+int main(int argc, char** argv) {
+    bool per_device = false;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--devices") == 0) per_device = true;
+        else {
+            fprintf(stderr, "usage: %s [--devices] [events...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // device, day -> per signal
+    std::map<std::pair<std::string, int32_t>, dist_t[SIGNALS]> devices;
+    std::set<std::tuple<std::string, int, double>> seen;
+    uint64_t malformed = 0, duplicates = 0;
+    bool ok = read_events(argc, argv, first, [&](const event_t& ev) {
+        if (!event_is(ev, "SKETCH")) return;
+        int signal;
+        double start;
+        dist_t d;
+        if (!parse_sketch(ev.data, signal, start, d)) {
+            malformed++;
+            return;
+        }
+        std::string device(ev.device);
+        if (!seen.insert(std::make_tuple(device, signal, start)).second) {
+            duplicates++;
+            return;
+        }
+        devices[std::make_pair(device, (int32_t)floor(start / DAY))][signal].merge(d);
+    });
+    if (!ok) return 1;
+
+    std::map<int32_t, dist_t[SIGNALS]> fleet;
+    dist_t all[SIGNALS];
+    printf("scope,day,signal,sources,n,mean,sd,min,max");
+    for (double q : QUANTILES) printf(",p%g", q * 100);
+    printf("\n");
+    for (const auto& d : devices) {
+        std::string day = day_name(d.first.second);
+        for (int s = 0; s < SIGNALS; s++) {
+            if (d.second[s].n == 0) continue;
+            if (per_device) print_row(d.first.first.c_str(), day.c_str(), s, d.second[s]);
+            dist_t one = d.second[s];
+            one.sources = 1;    // the fleet counts devices, not sketches
+            fleet[d.first.second][s].merge(one);
+        }
+    }
+    for (const auto& day : fleet) {
+        for (int s = 0; s < SIGNALS; s++) {
+            if (day.second[s].n == 0) continue;
+            print_row("fleet", day_name(day.first).c_str(), s, day.second[s]);
+            all[s].merge(day.second[s]);
+        }
+    }
+    for (int s = 0; s < SIGNALS; s++) {
+        if (all[s].n) print_row("fleet", "all", s, all[s]);
+    }
+    fprintf(stderr, "%zu device days, %zu days, %llu duplicate and %llu malformed SKETCH events\n", devices.size(),
+            fleet.size(), (unsigned long long)duplicates, (unsigned long long)malformed);
+    return 0;
+}
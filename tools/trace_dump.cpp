@@ -0,0 +1,129 @@
+/*
+ * Reassembles [t] trace captures from their TRACE chunks and dumps them as CSV, so a fast drain
+ * captured on site can be read next to its SoC/VCell samples.
+ *
+ *   TRACE s=<session>,c=<chunk>/<chunks>,t=<start, s since boot>,w=<base64 words>
+ *
+ * Chunks are grouped per device and session, ordered by c (a resent chunk replaces nothing, the
+ * first copy wins) and their little endian words concatenated.  Each word is a sample or a trace
+ * event, see capture_publish() in the firmware:
+ *   sample  [31] 0, [30:20] VCell - 2600 (mV), [19:10] SoC (0.1%), [9:0] seconds since boot
+ *   event   [31] 1, [30:24] trace event, [23:16] argument, [15:0] seconds since boot
+ * The seconds wrap, so they are unwrapped forward from the session's start.  Across a missing
+ * chunk that can be off by a wrap (1024 s for samples), so every session lists its missing chunks
+ * with the [T] command that resends each one.
+ *
+ *   trace_dump [--device id] [--session n] [events...]
+ */
+#include "events.h"
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+const uint16_t MV_MIN = 2600;   // HISTORY_MV_MIN
+const char* EVENT_NAMES[] = { "?", "boot", "task", "cmd", "publish", "sleep", "wake", "profile" };
+const int EVENT_COUNT = sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]);
+const int TRACE_CMD = 3, TRACE_PUBLISH = 4;     // their argument is a letter
+
+struct session_t {
+    double start = 0;       // s since boot
+    int chunks = 0;
+    std::map<int, std::vector<uint32_t>> words;     // by chunk
+};
+
+/*
+ * The smallest time at or after `now` whose low `bits` bits are `low`.
+ */
+double unwrap(double now, uint32_t low, int bits) {
+    uint64_t span = 1ull << bits;
+    uint64_t t = ((uint64_t)now & ~(span - 1)) | low;
+    if (t < (uint64_t)now) t += span;
+    return t;
+}
+
+int main(int argc, char** argv) {
+    std::string only_device;
+    long only_session = -1;
+    int first = 1;
+    for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        if (strcmp(argv[first], "--device") == 0) only_device = argv[first + 1];
+        else if (strcmp(argv[first], "--session") == 0) only_session = atol(argv[first + 1]);
+        else {
+            fprintf(stderr, "usage: %s [--device id] [--session n] [events...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::map<std::pair<std::string, int>, session_t> sessions;
+    uint64_t malformed = 0;
+    std::vector<uint8_t> bytes;
+    bool ok = read_events(argc, argv, first, [&](const event_t& ev) {
+        if (!event_is(ev, "TRACE")) return;
+        if (!only_device.empty() && ev.device != only_device) return;
+        // c=<chunk>/<chunks> isn't a plain number, so take it apart here
+        size_t c = ev.data.find("c="), slash = ev.data.find('/', c), w = ev.data.find(",w=");
+        double session = event_field(ev, "s"), start = event_field(ev, "t"), chunk, chunks;
+        bytes.clear();
+        if (isnan(session) || isnan(start) || c == std::string_view::npos || slash == std::string_view::npos
+                || w == std::string_view::npos || !parse_number(ev.data.substr(c + 2, slash - c - 2), chunk)
+                || !parse_number(ev.data.substr(slash + 1, ev.data.find(',', slash) - slash - 1), chunks)
+                || !base64_decode(ev.data.substr(w + 3), bytes) || bytes.size() % 4 != 0) {
+            malformed++;
+            return;
+        }
+        if (only_session >= 0 && session != only_session) return;
+        session_t& s = sessions[std::make_pair(std::string(ev.device), (int)session)];
+        s.start = start;
+        s.chunks = std::max(s.chunks, (int)chunks);
+        auto inserted = s.words.emplace((int)chunk, std::vector<uint32_t>());
+        if (!inserted.second) return;   // a resent copy
+        for (size_t i = 0; i < bytes.size(); i += 4) {
+            inserted.first->second.push_back(bytes[i] | bytes[i + 1] << 8 | bytes[i + 2] << 16 | (uint32_t)bytes[i + 3] << 24);
+        }
+    });
+    if (!ok) return 1;
+
+    printf("device,session,chunk,time_s,kind,soc,vcell,arg\n");
+    size_t incomplete = 0;
+    for (const auto& d : sessions) {
+        const std::string& device = d.first.first;
+        const session_t& s = d.second;
+        std::string missing;
+        for (int c = 0; c < s.chunks; c++) {
+            if (s.words.count(c)) continue;
+            missing += missing.empty() ? "" : " ";
+            missing += std::to_string(c);
+        }
+        printf("# %s s=%d t=%.0f chunks=%zu/%d missing=%s\n", device.c_str(), d.first.second, s.start,
+                s.words.size(), s.chunks, missing.empty() ? "-" : missing.c_str());
+        if (!missing.empty()) {
+            incomplete++;
+            fprintf(stderr, "%s session %d: resend with cmd \"T <chunk>\" for chunks %s\n", device.c_str(),
+                    d.first.second, missing.c_str());
+        }
+        double now = s.start;
+        for (const auto& chunk : s.words) {
+            for (uint32_t word : chunk.second) {
+                if (word & 0x80000000) {
+                    int event = (word >> 24) & 0x7F;
+                    int arg = (word >> 16) & 0xFF;
+                    now = unwrap(now, word & 0xFFFF, 16);
+                    const char* name = (event < EVENT_COUNT) ? EVENT_NAMES[event] : "?";
+                    if ((event == TRACE_CMD || event == TRACE_PUBLISH) && arg >= 0x20 && arg < 0x7F) {
+                        printf("%s,%d,%d,%.0f,%s,,,%c\n", device.c_str(), d.first.second, chunk.first, now, name, arg);
+                    }
+                    else printf("%s,%d,%d,%.0f,%s,,,%d\n", device.c_str(), d.first.second, chunk.first, now, name, arg);
+                }
+                else {
+                    now = unwrap(now, word & 0x3FF, 10);
+                    printf("%s,%d,%d,%.0f,sample,%.1f,%.3f,\n", device.c_str(), d.first.second, chunk.first, now,
+                            ((word >> 10) & 0x3FF) / 10.0, (((word >> 20) & 0x7FF) + MV_MIN) / 1000.0);
+                }
+            }
+        }
+    }
+    fprintf(stderr, "%zu sessions, %zu with missing chunks, %llu malformed TRACE events\n", sessions.size(),
+            incomplete, (unsigned long long)malformed);
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Per-device digital twin - keeps every device's predicted battery state current from its
+ * events, and forecasts time to the hibernate threshold and brownout risk.
+ *
+ * Each event updates its device's twin in O(1), nothing is re-simulated, so one process keeps up
+ * with the whole fleet.  What each twin learns, incrementally:
+ *   slope     SoC change while awake (%/h), EWMA over consecutive UPDATEs
+ *   dv_dsoc   VCell per % of SoC, the battery's discharge curve around where it runs
+ *   gain      SoC change per hour of hibernate (%/h, SLEEP to WAKE), what its charger brings in
+ *   sag       VCell drop with the modem connected (DIAG sag=), the modem's load on the battery
+ *   rates     the CHARZ current table (modem tx, modem idle, cpu busy %/h), the slope until
+ *             UPDATEs have taught it one, then DIAG dis=
+ * A device is predicted to hit its threshold at the current slope, and its VCell there is
+ * extrapolated along dv_dsoc.  Brownout risk scores how close that VCell minus the modem sag
+ * gets to the modem's brownout voltage: 0.5 at the brownout voltage, ~0.1 / 0.9 at 65mV above
+ * / below it.  A sleeping device gains SoC at its gain until its timer wake, and counts as awake
+ * from then on even before its WAKE arrives; wake_in_h is the hours until that wake.
+ *
+ *   twin [--brownout 3.30] [--every seconds] [--at unix time] [events...]
+ *
+ * --every prints a fleet summary line per that much event time while reading, and the end
+ * prints every device's twin as CSV, soonest to the threshold first.
+ */
+#include "events.h"
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+const double ALPHA = 0.2;                   // EWMA weight of a new observation
+const double MAX_SLOPE_GAP = 2 * 60 * 60;   // seconds, longer gaps don't count as a slope
+const double STALE = 2 * 60 * 60;           // awake but silent this long
+const double RISK_SCALE = 0.03;             // V, see brownout_risk()
+const double DEFAULT_THRESHOLD = 20;
+
+enum twin_state_t { AWAKE, SLEEPING };
+const char* STATE_NAMES[] = { "awake", "sleeping" };
+
+struct twin_t {
+    twin_state_t state = AWAKE;
+    double t = 0;               // last event
+    double soc = NAN;
+    double vcell = NAN;
+    double threshold = DEFAULT_THRESHOLD;
+    double slope = NAN;         // %/h while awake
+    double dv_dsoc = NAN;       // V/%
+    double gain = 0;            // %/h while hibernating
+    double sag = 0;             // V
+    double dis = NAN;           // %/h, DIAG
+    double charz_idle = NAN;    // %/h, CHARZ modem idle
+    double sample_t = 0;        // last UPDATE, for the slope
+    double sample_soc = NAN;
+    double sample_vcell = NAN;
+    double sleep_t = 0;
+    double sleep_soc = NAN;
+    double wake_at = 0;
+};
+
+struct forecast_t {
+    twin_state_t state;
+    double soc;
+    double vcell;
+    double slope;
+    double tth;         // hours to the threshold, 0 at or below it, INFINITY if not discharging
+    double wake_in;     // hours to the expected wake, NAN while awake
+    double loaded_v;    // VCell under modem load at the threshold (or now if it won't get there)
+    double risk;
+    bool stale;
+};
+
+double ewma(double avg, double x) {
+    return isnan(avg) ? x : avg + ALPHA * (x - avg);
+}
+
+double brownout_risk(double loaded_v, double brownout) {
+    return 1 / (1 + exp((loaded_v - brownout) / RISK_SCALE));
+}
+
+void take_stats(twin_t& tw, const event_t& ev) {
+    double soc, vcell;
+    if (!event_stats(ev, soc, vcell)) return;
+    tw.soc = soc;
+    tw.vcell = vcell;
+}
+
+/*
+ * One event into its device's twin.
+ */
+void apply(twin_t& tw, const event_t& ev) {
+    if (ev.time < tw.t) return;     // out of order, the twin is already past it
+    tw.t = ev.time;
+    if (event_is(ev, "UPDATE")) {
+        take_stats(tw, ev);
+        tw.state = AWAKE;
+        double dt = ev.time - tw.sample_t;
+        if (!isnan(tw.sample_soc) && dt > 0 && dt <= MAX_SLOPE_GAP) {
+            tw.slope = ewma(tw.slope, (tw.soc - tw.sample_soc) * 3600 / dt);
+            double dsoc = tw.soc - tw.sample_soc;
+            if (fabs(dsoc) >= 0.5) tw.dv_dsoc = ewma(tw.dv_dsoc, (tw.vcell - tw.sample_vcell) / dsoc);
+        }
+        tw.sample_t = ev.time;
+        tw.sample_soc = tw.soc;
+        tw.sample_vcell = tw.vcell;
+    }
+    else if (event_is(ev, "SLEEP")) {
+        take_stats(tw, ev);
+        tw.state = SLEEPING;
+        tw.sleep_t = ev.time;
+        tw.sleep_soc = tw.soc;
+        tw.wake_at = ev.time + event_field(ev, "dur", 0);
+        tw.threshold = event_field(ev, "thr", tw.threshold);
+        tw.sample_soc = NAN;        // no slope across the hibernate
+    }
+    else if (event_is(ev, "WAKE")) {
+        take_stats(tw, ev);
+        if (tw.state == SLEEPING && ev.time > tw.sleep_t) {
+            tw.gain = ewma(tw.gain, (tw.soc - tw.sleep_soc) * 3600 / (ev.time - tw.sleep_t));
+        }
+        tw.state = AWAKE;
+        tw.sample_soc = NAN;
+    }
+    else if (event_is(ev, "DIAG")) {
+        double sag = event_field(ev, "sag");
+        if (sag > 0) tw.sag = sag / 1000;
+        tw.dis = event_field(ev, "dis", tw.dis);
+    }
+    else if (event_is(ev, "CHARZ")) {
+        // "<reason> <from>-<to>(%) <n>min,<tx>(%/h),<idle>(%/h),<busy>(%/h)"
+        std::string_view data = ev.data;
+        for (int field = 0; field < 2; field++) {
+            size_t comma = data.find(',');
+            if (comma == std::string_view::npos) return;
+            data.remove_prefix(comma + 1);
+        }
+        double idle;
+        if (parse_number(data.substr(0, data.find('(')), idle) && idle > 0) tw.charz_idle = idle;
+    }
+}
+
+forecast_t predict(const twin_t& tw, double at, double brownout) {
+    forecast_t f;
+    double slope = !isnan(tw.slope) ? tw.slope : !isnan(tw.charz_idle) ? -tw.charz_idle : -tw.dis;
+    auto clamp = [](double soc) { return std::min(100.0, std::max(0.0, soc)); };
+    f.slope = slope;
+    f.stale = false;
+    f.wake_in = NAN;
+    f.state = tw.state;
+    f.soc = tw.soc;
+    double wake_soc = NAN;     // predicted SoC at the timer wake
+    if (tw.state == SLEEPING) {
+        wake_soc = clamp(tw.soc + tw.gain * std::max(0.0, tw.wake_at - tw.t) / 3600);
+        if (at >= tw.wake_at) {
+            // the timer woke it, its WAKE just isn't in yet
+            f.state = AWAKE;
+            f.soc = isnan(slope) ? wake_soc : wake_soc + slope * (at - tw.wake_at) / 3600;
+            f.stale = at - tw.wake_at > STALE;
+        }
+        else {
+            f.soc = tw.soc + tw.gain * std::max(0.0, at - tw.t) / 3600;
+            f.wake_in = (tw.wake_at - at) / 3600;
+        }
+    }
+    else if (!isnan(slope)) {
+        f.soc = tw.soc + slope * std::max(0.0, at - tw.t) / 3600;
+        f.stale = at - tw.t > STALE;
+    }
+    f.soc = clamp(f.soc);
+    double dv_dsoc = isnan(tw.dv_dsoc) ? 0 : tw.dv_dsoc;
+    f.vcell = tw.vcell + dv_dsoc * (f.soc - tw.soc);
+
+    f.tth = INFINITY;
+    double at_threshold = f.soc;
+    if (f.soc <= tw.threshold) f.tth = 0;
+    else if (f.state == SLEEPING) {
+        // it sleeps until the wake, and drains at the awake slope from there
+        if (wake_soc <= tw.threshold) f.tth = (f.soc - tw.threshold) / -tw.gain;  // only if gain < 0
+        else if (slope < 0) f.tth = f.wake_in + (wake_soc - tw.threshold) / -slope;
+    }
+    else if (slope < 0) f.tth = (f.soc - tw.threshold) / -slope;
+    if (!isinf(f.tth)) at_threshold = std::min(f.soc, tw.threshold);
+    f.loaded_v = f.vcell + dv_dsoc * (at_threshold - f.soc) - tw.sag;
+    f.risk = isnan(f.loaded_v) ? NAN : brownout_risk(f.loaded_v, brownout);
+    return f;
+}
+
+int main(int argc, char** argv) {
+    double brownout = 3.30;
+    double every = 0;
+    double at = 0;
+    int first = 1;
+    for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+        if (strcmp(argv[first], "--brownout") == 0) brownout = atof(argv[first + 1]);
+        else if (strcmp(argv[first], "--every") == 0) every = atof(argv[first + 1]);
+        else if (strcmp(argv[first], "--at") == 0) at = atof(argv[first + 1]);
+        else {
+            fprintf(stderr, "usage: %s [--brownout V] [--every seconds] [--at unix time] [events...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::unordered_map<std::string, twin_t> twins;
+    twins.reserve(1 << 16);
+    std::string key;
+    double now = 0;
+    double next_summary = 0;
+    uint64_t events = 0;
+    auto summary = [&](double t) {
+        size_t sleeping = 0, soon = 0, risky = 0;
+        for (const auto& d : twins) {
+            forecast_t f = predict(d.second, t, brownout);
+            if (f.state == SLEEPING) sleeping++;
+            else if (f.tth < 6) soon++;
+            if (f.risk >= 0.5) risky++;
+        }
+        printf("# %.0f devices=%zu sleeping=%zu threshold_in_6h=%zu brownout_risk=%zu\n", t, twins.size(), sleeping, soon, risky);
+    };
+    bool ok = read_events(argc, argv, first, [&](const event_t& ev) {
+        if (every > 0 && ev.time >= next_summary) {
+            if (next_summary > 0) summary(next_summary);
+            next_summary = (floor(ev.time / every) + 1) * every;
+        }
+        key.assign(ev.device);
+        apply(twins[key], ev);
+        now = std::max(now, ev.time);
+        events++;
+    });
+    if (!ok) return 1;
+    if (at == 0) at = now;
+
+    std::vector<std::pair<const std::string*, forecast_t>> rows;
+    rows.reserve(twins.size());
+    for (const auto& d : twins) {
+        if (isnan(d.second.soc)) continue;  // only DIAG so far
+        rows.push_back(std::make_pair(&d.first, predict(d.second, at, brownout)));
+    }
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.tth < b.second.tth; });
+
+    printf("device,state,soc,vcell,slope_pct_h,threshold,tth_h,wake_in_h,loaded_v,brownout_risk,last_seen_s\n");
+    for (const auto& row : rows) {
+        const twin_t& tw = twins[*row.first];
+        const forecast_t& f = row.second;
+        printf("%s,%s,%.1f,%.3f,%.2f,%.0f,%.2f,%.2f,%.3f,%.2f,%.0f\n", row.first->c_str(),
+                f.stale ? "stale" : STATE_NAMES[f.state], f.soc, f.vcell, f.slope, tw.threshold, f.tth, f.wake_in,
+                f.loaded_v, f.risk, at - tw.t);
+    }
+    fprintf(stderr, "%llu events, %zu devices\n", (unsigned long long)events, twins.size());
+    return 0;
+}